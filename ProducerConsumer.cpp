@@ -5,27 +5,131 @@
 #include <mutex>
 #include <vector>
 #include <queue>
+#include <atomic>
+#include <string>
+#include <chrono>
+#include <cassert>
+
+#include "data_structures/EventCount.h"
+#include "data_structures/Pipeline.h"
 
 using namespace std;
 
-class CustomSemaphore {
-    int cnt_;
-    std::mutex cnt_mut_;
-    std::condition_variable cnt_cnd_;
+/*
+Bounded MPMC queue with a sequence number per slot (Vyukov's array queue).
+
+Slot i starts with seq == i. A producer that got ticket pos may write slot pos & mask_ once its
+seq == pos, and publishes it by setting seq = pos + 1. A consumer with ticket pos may read the slot
+once seq == pos + 1 and hands it back to the producer of the next lap with seq = pos + capacity.
+Producers and consumers each CAS their own counter (enq_ / deq_) and then work on their own slot,
+so a push/pop pair is two CAS and a few loads, where the semaphore version took six locks.
+
+A slot whose seq is behind our ticket means the queue is full (push) or empty (pop). Only then do
+the blocking variants park, on an EventCount, and the other side only makes a syscall to wake them
+when somebody is parked.
+*/
+template <typename T>
+class BoundedQueue {
+    struct Cell {
+        atomic<size_t> seq;
+        T data;
+    };
+
+    const size_t mask_;
+    unique_ptr<Cell[]> cells_;
+    alignas(64) atomic<size_t> enq_;
+    alignas(64) atomic<size_t> deq_;
+    alignas(64) EventCount not_empty_;
+    EventCount not_full_;
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 2;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
 
     public:
-    CustomSemaphore(int cnt) : cnt_(cnt) {}
 
-    void signal() {
-       std::lock_guard<std::mutex> lk(cnt_mut_);
-       cnt_++;
-       cnt_cnd_.notify_one();
+    BoundedQueue(size_t capacity) : mask_(roundUp(capacity) - 1), cells_(new Cell[mask_ + 1]), enq_(0), deq_(0) {
+        for (size_t i = 0; i <= mask_; i++) {
+            cells_[i].seq.store(i, memory_order_relaxed);
+        }
     }
 
-    void wait() {
-        std::unique_lock<std::mutex> lk(cnt_mut_);
-        cnt_cnd_.wait(lk, [this](){return cnt_ > 0;}); // If the condition holds true, then waiting is done.
-        cnt_--;
+    BoundedQueue(const BoundedQueue& other) = delete;
+    BoundedQueue& operator=(const BoundedQueue& other) = delete;
+
+    // value is only moved from if the push succeeded.
+    bool TryPush(T& value) {
+        size_t pos = enq_.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enq_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                // Slot still holds the element from the previous lap, full.
+                return false;
+            } else {
+                pos = enq_.load(memory_order_relaxed);
+            }
+        }
+
+        cell->data = std::move(value);
+        cell->seq.store(pos + 1, memory_order_release);
+        not_empty_.NotifyOne();
+        return true;
+    }
+
+    bool TryPop(T& value) {
+        size_t pos = deq_.load(memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells_[pos & mask_];
+            size_t seq = cell->seq.load(memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (dif == 0) {
+                if (deq_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                // Slot not written yet, empty.
+                return false;
+            } else {
+                pos = deq_.load(memory_order_relaxed);
+            }
+        }
+
+        value = std::move(cell->data);
+        cell->seq.store(pos + mask_ + 1, memory_order_release);
+        not_full_.NotifyOne();
+        return true;
+    }
+
+    void Push(T value) {
+        Await(not_full_, [&]() { return TryPush(value); });
+    }
+
+    // Returns false if the queue stayed full for duration_ms.
+    bool TimedPush(T& value, int duration_ms) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(duration_ms);
+        return AwaitUntil(not_full_, [&]() { return TryPush(value); }, deadline);
+    }
+
+    void WaitAndPop(T& value) {
+        Await(not_empty_, [&]() { return TryPop(value); });
+    }
+
+    // Returns false if the queue stayed empty for duration_ms.
+    bool TimedWaitAndPop(T& value, int duration_ms) {
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(duration_ms);
+        return AwaitUntil(not_empty_, [&]() { return TryPop(value); }, deadline);
     }
 };
 
@@ -34,62 +138,112 @@ struct Task {
 };
 
 class ProducerConsumer {
-    queue<shared_ptr<Task> > tasks_;
-    shared_ptr<CustomSemaphore> mt_;
-    shared_ptr<CustomSemaphore> task_sig_;
-    shared_ptr<CustomSemaphore> buffer_size_;
+    BoundedQueue<shared_ptr<Task> > tasks_;
 
     public:
 
-    ProducerConsumer(int buffer_sz) : mt_(make_shared<CustomSemaphore>(1)),
-    task_sig_(make_shared<CustomSemaphore>(0)),
-    buffer_size_(make_shared<CustomSemaphore>(buffer_sz)) {}
+    ProducerConsumer(int buffer_sz) : tasks_(buffer_sz) {}
 
     void ProcessTask(shared_ptr<Task> tsk) {
         printf("Command : %s\n", tsk->command_.c_str());
     }
 
+    // Blocks only while the buffer is full.
     void Producer(shared_ptr<Task> tsk) {
-        buffer_size_->wait();
-        mt_->wait();
-        tasks_.push(tsk);
-        mt_->signal();
-        task_sig_->signal();
+        tasks_.Push(tsk);
     } 
 
     void Consumer() {
-        task_sig_->wait();
-        mt_->wait();
-        auto tsk = tasks_.front();
-        tasks_.pop();
-        mt_->signal();
-        buffer_size_->signal();
+        shared_ptr<Task> tsk;
+        tasks_.WaitAndPop(tsk);
         ProcessTask(tsk);
     }
 };
 
+/*
+close() marks the end of the stream. After it:
+1. push is rejected.
+2. Consumers blocked in wait_and_pop / timed_wait_and_pop wake up immediately.
+3. The remaining items are still handed out, and once the queue is drained the pops return nullptr,
+   which is the end-of-stream signal. Consumers can therefore block without a timeout and still
+   shut down promptly.
+
+Consumers park on an EventCount rather than a condition variable, so a push with no parked consumer
+does not issue any notify.
+*/
 template <typename T> 
 class ConcurrentQueue {
     queue<shared_ptr<T> > q_;
-    condition_variable insert_;
+    EventCount insert_;
     mutex q_mt_;
-    chrono::duration<float> wait_time_;
+    chrono::milliseconds wait_time_;
+    bool closed_;
+
+    // Call holding lk. Returns with lk held once there is an item or the queue is closed, or false
+    // if the deadline passed first.
+    bool waitForItem(std::unique_lock<mutex>& lk, const chrono::steady_clock::time_point* deadline) {
+        while (q_.empty() && !closed_) {
+            uint32_t key = insert_.PrepareWait();
+            if (!q_.empty() || closed_) {
+                insert_.CancelWait();
+                break;
+            }
+            lk.unlock();
+            bool notified = true;
+            if (deadline) {
+                notified = insert_.WaitUntil(key, *deadline);
+            } else {
+                insert_.Wait(key);
+            }
+            lk.lock();
+            if (!notified) {
+                return !q_.empty() || closed_;
+            }
+        }
+        return true;
+    }
     
     public:
 
-    ConcurrentQueue(int duration_ms = 10) : wait_time_(chrono::milliseconds(duration_ms)) {}
+    ConcurrentQueue(int duration_ms = 10) : wait_time_(chrono::milliseconds(duration_ms)), closed_(false) {}
  
-    void push(shared_ptr<T> task) {
+    // Returns false if the queue has been closed.
+    bool push(shared_ptr<T> task) {
+        {
+            std::lock_guard<mutex> lk(q_mt_);
+            if (closed_) {
+                return false;
+            }
+            q_.push(task);
+        }
+        insert_.NotifyOne();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<mutex> lk(q_mt_);
+            closed_ = true;
+        }
+        insert_.NotifyAll();
+    }
+
+    bool closed() {
         std::lock_guard<mutex> lk(q_mt_);
-        q_.push(task);
-        insert_.notify_one();
+        return closed_;
     }
 
     shared_ptr<T> timed_wait_and_pop() {
         std::unique_lock<mutex> lk(q_mt_);
         // 10 s, 50 s
         // 60 s -> jaayega hi jaayega.
-        if (!insert_.wait_for(lk, wait_time_, [this]() {return !q_.empty();})) {
+        auto deadline = chrono::steady_clock::now() + wait_time_;
+        if (!waitForItem(lk, &deadline)) {
+            return nullptr;
+        }
+
+        if (q_.empty()) {
+            // Closed and drained.
             return nullptr;
         }
 
@@ -98,9 +252,14 @@ class ConcurrentQueue {
         return item;
     }
 
+    // Blocks until an item is available. Returns nullptr only once the queue is closed and empty.
     shared_ptr<T> wait_and_pop() {
         std::unique_lock<mutex> lk(q_mt_);
-        insert_.wait(lk, [this](){ return !q_.empty();});
+        waitForItem(lk, nullptr);
+
+        if (q_.empty()) {
+            return nullptr;
+        }
 
         shared_ptr<T> item = q_.front();
         q_.pop();
@@ -126,19 +285,22 @@ class ConcurrentQueue {
 
 class CustomProducerConsumer {
     ConcurrentQueue<Task> q_;
-    volatile atomic_bool done_;
+    atomic<int> producers_left_;
 
     public:
 
-    CustomProducerConsumer() : done_(false) {}
+    CustomProducerConsumer(int producers = 1) : producers_left_(producers) {}
 
     void Producer(Task tsk) {
-        int rnd = 10;
         for (int i = 0; i < 10; i++) {
             shared_ptr<Task> tsk_ptr = make_shared<Task> (tsk);
             q_.push(tsk_ptr);
         }
-        done_ = true;
+
+        // The last producer to finish ends the stream.
+        if (--producers_left_ == 0) {
+            q_.close();
+        }
     }
 
     void ProcessTask(shared_ptr<Task> tsk) {
@@ -146,15 +308,9 @@ class CustomProducerConsumer {
     }
 
     void Consumer() {
-        shared_ptr<Task> tsk = nullptr;
-        while (!done_ || !q_.empty()) {
-            tsk = q_.timed_wait_and_pop();
-            if (tsk == nullptr) {
-                continue;
-            }
-            shared_ptr<Task> cur_task = tsk;
-            tsk = nullptr;
-            ProcessTask(cur_task);
+        // No timeout needed, wait_and_pop returns nullptr once the producers closed the queue.
+        while (shared_ptr<Task> tsk = q_.wait_and_pop()) {
+            ProcessTask(tsk);
         }
     }
 };
@@ -163,7 +319,7 @@ void ProducerConsumerTest() {
     int prds = 1;
     int cons = 4;
     vector<unique_ptr<thread> > threads;
-    CustomProducerConsumer test;
+    CustomProducerConsumer test(prds);
 
     for (int i = 0; i < prds; i++) {
         Task tsk;
@@ -183,6 +339,99 @@ void ProducerConsumerTest() {
     printf("Test completed Succcessfully\n");
 }
 
+// Same stream as CustomProducerConsumer built with Pipeline: the tasks get a parse stage in
+// between, and the sink keeps the producer's order even with several parse workers.
+void PipelineProducerConsumerTest() {
+    Pipeline p;
+    int produced = 0;
+    auto tasks = p.source<Task>("produce", {1, false, 1, 4}, [&produced](Task& tsk) {
+        tsk.command_ = to_string(produced);
+        return produced++ < 10;
+    });
+    auto parsed = p.stage("parse", tasks, {4, true, 2, 4}, [](Task tsk) {
+        tsk.command_ = "run " + tsk.command_;
+        return tsk;
+    });
+    int consumed = 0;
+    p.sink("consume", parsed, {1, false, 4, 4}, [&consumed](Task tsk) {
+        assert(tsk.command_ == "run " + to_string(consumed));
+        consumed++;
+        printf("Command : %s\n", tsk.command_.c_str());
+    });
+    p.run();
+    assert(consumed == 10);
+    printf("Pipeline test completed Succcessfully\n");
+}
+
+void BoundedQueueTest() {
+    // A tiny buffer so producers really have to block on a full queue.
+    BoundedQueue<long> q(4);
+    int prds = 4;
+    int cons = 4;
+    long per_producer = 100000;
+    atomic<long> sum(0);
+    vector<thread> threads;
+
+    for (int i = 0; i < prds; i++) {
+        threads.push_back(thread([&q, per_producer]() {
+            for (long v = 1; v <= per_producer; v++) {
+                q.Push(v);
+            }
+        }));
+    }
+
+    for (int i = 0; i < cons; i++) {
+        threads.push_back(thread([&q, &sum, prds, cons, per_producer]() {
+            long local = 0;
+            for (long n = 0; n < prds * per_producer / cons; n++) {
+                long v;
+                q.WaitAndPop(v);
+                local += v;
+            }
+            sum += local;
+        }));
+    }
+
+    for (auto& t: threads) {
+        t.join();
+    }
+    assert(sum == prds * per_producer * (per_producer + 1) / 2);
+
+    long v = 1;
+    bool ok = q.TimedWaitAndPop(v, 10);
+    assert(!ok);
+    int pushed = 0;
+    for (int i = 0; i < 4; i++) {
+        pushed += q.TryPush(v);
+    }
+    assert(pushed == 4);
+    ok = q.TryPush(v);
+    assert(!ok);
+    ok = q.TimedPush(v, 10);
+    assert(!ok);
+    printf("BoundedQueue test completed Succcessfully\n");
+}
+
+void BufferedProducerConsumerTest() {
+    ProducerConsumer pc(2);
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread([&pc, i]() {
+            Task tsk;
+            tsk.command_ = to_string(i);
+            pc.Producer(make_shared<Task>(tsk));
+        }));
+        threads.push_back(thread(&ProducerConsumer::Consumer, &pc));
+    }
+
+    for (auto& t: threads) {
+        t.join();
+    }
+}
+
 int main() {
     ProducerConsumerTest();
+    PipelineProducerConsumerTest();
+    BoundedQueueTest();
+    BufferedProducerConsumerTest();
 }
\ No newline at end of file
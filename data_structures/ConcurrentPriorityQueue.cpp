@@ -0,0 +1,335 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <set>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cassert>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+Concurrent priority queue as a MultiQueue (Rihani, Sanders, Dementiev).
+
+A std::set or heap under one mutex serializes every scheduler and pool on one lock. Here there are
+several heaps, each with its own lock:
+
+1. push locks a random heap (try_lock, another random one if busy) and inserts there.
+2. Every heap publishes its smallest priority in an atomic top, LONG_MAX when empty, so the tops can
+   be compared without taking any lock.
+3. Relaxed pop: look at the tops of two random heaps and pop from the smaller one. The element is
+   not always the global minimum but close to it: on average it is within O(number of heaps) ranks
+   of the minimum, and two choices keep the heaps balanced.
+4. Strict pop: compare the tops of all heaps and pop from the smallest, retrying if it changed
+   before we got the lock. With one heap this is an ordinary locked heap.
+
+So the number of heaps and the mode trade order for scalability: 1 heap is strict and serial,
+2 * threads heaps with relaxed pops scale and are what the paper recommends.
+
+pop_min parks on an EventCount until something is pushed.
+*/
+template <typename T>
+class ConcurrentPriorityQueue {
+    struct Entry {
+        long prio;
+        T item;
+
+        // Inverted, std heaps are max heaps.
+        bool operator<(const Entry& other) const {
+            return prio > other.prio;
+        }
+    };
+
+    struct alignas(64) Heap {
+        mutex mt;
+        vector<Entry> entries;
+        atomic<long> top;
+
+        Heap() : top(LONG_MAX) {}
+
+        // Call holding mt.
+        void publishTop() {
+            top.store(entries.empty() ? LONG_MAX : entries.front().prio, memory_order_release);
+        }
+    };
+
+    const size_t n_heaps_;
+    const bool strict_;
+    unique_ptr<Heap[]> heaps_;
+    atomic<long> sz_;
+    EventCount not_empty_;
+
+    size_t randomHeap() {
+        thread_local minstd_rand rng(hash<thread::id> {} (this_thread::get_id()));
+        return rng() % n_heaps_;
+    }
+
+    // Call holding heap.mt with the heap non empty.
+    void popFrom(Heap& heap, T& item, long* prio) {
+        pop_heap(heap.entries.begin(), heap.entries.end());
+        Entry& e = heap.entries.back();
+        if (prio) {
+            *prio = e.prio;
+        }
+        item = std::move(e.item);
+        heap.entries.pop_back();
+        heap.publishTop();
+        sz_.fetch_sub(1, memory_order_relaxed);
+    }
+
+    // Locks best and pops if its top is still seen_top.
+    bool tryPopAt(Heap& best, long seen_top, T& item, long* prio) {
+        lock_guard<mutex> lk(best.mt);
+        if (best.entries.empty() || best.entries.front().prio != seen_top) {
+            return false;
+        }
+        popFrom(best, item, prio);
+        return true;
+    }
+
+    bool popRelaxed(T& item, long* prio) {
+        for (int attempt = 0; attempt < 4; attempt++) {
+            Heap& a = heaps_[randomHeap()];
+            Heap& b = heaps_[randomHeap()];
+            long top_a = a.top.load(memory_order_acquire);
+            long top_b = b.top.load(memory_order_acquire);
+            if (top_a == LONG_MAX && top_b == LONG_MAX) {
+                break;
+            }
+            Heap& best = top_a <= top_b ? a : b;
+            if (tryPopAt(best, min(top_a, top_b), item, prio)) {
+                return true;
+            }
+        }
+        // The samples kept missing, look at every heap before reporting empty.
+        return popStrict(item, prio);
+    }
+
+    bool popStrict(T& item, long* prio) {
+        while (true) {
+            Heap* best = nullptr;
+            long best_top = LONG_MAX;
+            for (size_t i = 0; i < n_heaps_; i++) {
+                long top = heaps_[i].top.load(memory_order_acquire);
+                if (top < best_top) {
+                    best_top = top;
+                    best = &heaps_[i];
+                }
+            }
+            if (!best) {
+                return false;
+            }
+            if (tryPopAt(*best, best_top, item, prio)) {
+                return true;
+            }
+        }
+    }
+
+    public:
+
+    explicit ConcurrentPriorityQueue(size_t heaps = 2 * thread::hardware_concurrency(), bool strict = false) :
+    n_heaps_(max<size_t>(heaps, 1)),
+    strict_(strict),
+    heaps_(new Heap[n_heaps_]),
+    sz_(0) {}
+
+    ConcurrentPriorityQueue(const ConcurrentPriorityQueue& other) = delete;
+    ConcurrentPriorityQueue& operator=(const ConcurrentPriorityQueue& other) = delete;
+
+    // Smaller prio comes out first.
+    void push(long prio, T item) {
+        assert(prio != LONG_MAX);
+        Heap* heap = &heaps_[randomHeap()];
+        unique_lock<mutex> lk(heap->mt, try_to_lock);
+        while (!lk.owns_lock()) {
+            heap = &heaps_[randomHeap()];
+            lk = unique_lock<mutex>(heap->mt, try_to_lock);
+        }
+
+        heap->entries.push_back(Entry{prio, std::move(item)});
+        push_heap(heap->entries.begin(), heap->entries.end());
+        heap->publishTop();
+        lk.unlock();
+
+        sz_.fetch_add(1, memory_order_relaxed);
+        not_empty_.NotifyOne();
+    }
+
+    // Pops the minimum (strict) or an element close to it (relaxed). Returns false if empty.
+    bool try_pop_min(T& item, long* prio = nullptr) {
+        return strict_ ? popStrict(item, prio) : popRelaxed(item, prio);
+    }
+
+    void pop_min(T& item, long* prio = nullptr) {
+        Await(not_empty_, [&]() { return try_pop_min(item, prio); });
+    }
+
+    long sz() {
+        return sz_.load(memory_order_relaxed);
+    }
+};
+
+// The baseline the schedulers use today.
+template <typename T>
+class LockedSetPriorityQueue {
+    multiset<pair<long, T> > set_;
+    mutex mt_;
+
+    public:
+
+    void push(long prio, T item) {
+        lock_guard<mutex> lk(mt_);
+        set_.emplace(prio, std::move(item));
+    }
+
+    bool try_pop_min(T& item, long* prio = nullptr) {
+        lock_guard<mutex> lk(mt_);
+        if (set_.empty()) {
+            return false;
+        }
+        auto node = set_.extract(set_.begin());
+        if (prio) {
+            *prio = node.value().first;
+        }
+        item = std::move(node.value().second);
+        return true;
+    }
+};
+
+void testStrict() {
+    for (size_t heaps : {1, 8}) {
+        ConcurrentPriorityQueue<int> pq(heaps, true);
+        vector<long> prios;
+        minstd_rand rng(7);
+        for (int i = 0; i < 10000; i++) {
+            prios.push_back(rng() % 100000);
+            pq.push(prios.back(), i);
+        }
+        sort(prios.begin(), prios.end());
+
+        int item;
+        long prio;
+        for (long expected : prios) {
+            bool popped = pq.try_pop_min(item, &prio);
+            assert(popped && prio == expected);
+        }
+        bool popped = pq.try_pop_min(item);
+        assert(!popped);
+    }
+    cout << "Strict order test passed" << endl;
+}
+
+// Relaxed pops return everything exactly once, and never far from the minimum.
+void testRelaxed() {
+    const size_t heaps = 8;
+    ConcurrentPriorityQueue<long> pq(heaps);
+    const long n = 20000;
+    for (long i = 0; i < n; i++) {
+        pq.push(i, i);
+    }
+
+    vector<bool> seen(n, false);
+    long worst_rank = 0;
+    long popped = 0;
+    long item;
+    while (pq.try_pop_min(item)) {
+        assert(!seen[item]);
+        seen[item] = true;
+        // Items are 0..n-1, so the rank of item is the number of smaller items still queued.
+        long rank = 0;
+        for (long j = 0; j < item; j++) {
+            rank += !seen[j];
+        }
+        worst_rank = max(worst_rank, rank);
+        popped++;
+    }
+    assert(popped == n);
+    assert(worst_rank < 64 * (long)heaps);
+    cout << "Relaxed test passed, worst rank " << worst_rank << endl;
+}
+
+void testBlocking() {
+    ConcurrentPriorityQueue<long> pq(4);
+    const int producers = 4;
+    const long per_producer = 20000;
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&pq, p, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                pq.push(i, p * per_producer + i);
+            }
+        }));
+    }
+
+    atomic<long> sum(0);
+    for (int c = 0; c < 2; c++) {
+        threads.push_back(thread([&pq, &sum, producers, per_producer]() {
+            long local = 0;
+            for (long i = 0; i < producers * per_producer / 2; i++) {
+                long v;
+                pq.pop_min(v);
+                local += v;
+            }
+            sum += local;
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    long n = producers * per_producer;
+    assert(sum == n * (n - 1) / 2);
+    assert(pq.sz() == 0);
+    cout << "Blocking test passed" << endl;
+}
+
+// Every thread alternates push / try_pop_min, like a scheduler arming and firing timers.
+template <typename PQ>
+void bench(const string& name, PQ& pq, int threads) {
+    const long ops = 400000;
+    long per_thread = ops / threads;
+    for (long i = 0; i < 1000; i++) {
+        pq.push(i, i);
+    }
+
+    vector<thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&pq, per_thread, t]() {
+            minstd_rand rng(t + 1);
+            long v;
+            for (long i = 0; i < per_thread; i++) {
+                pq.push(rng() % 1000000, i);
+                pq.try_pop_min(v);
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << name << ", " << threads << " threads: " << (2 * per_thread * threads / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testStrict();
+    testRelaxed();
+    testBlocking();
+
+    for (int threads : {1, 4, 16, 64}) {
+        LockedSetPriorityQueue<long> locked;
+        bench("set + mutex", locked, threads);
+        ConcurrentPriorityQueue<long> strict(2 * threads, true);
+        bench("multiqueue strict", strict, threads);
+        ConcurrentPriorityQueue<long> relaxed(2 * threads);
+        bench("multiqueue relaxed", relaxed, threads);
+    }
+}
@@ -0,0 +1,315 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+Disruptor style ring buffer (LMAX).
+
+Instead of one queue per hop (decode -> queue -> enrich -> queue -> persist), every event lives in
+one pre-allocated ring and the stages walk over it one after the other:
+
+    producers ---claim/publish---> [ ring of events ] <--- decode <--- enrich <--- persist
+                                                            cursor      cursor      cursor
+
+1. A producer claims the next sequence number with a fetch_add, fills the event in place and
+   publishes it by stamping the slot with its sequence number. Several producers can fill their
+   slots at the same time, a stage only goes as far as the contiguous run of stamped slots.
+2. Every stage has its own cursor (the last sequence it finished) and a barrier: the list of stages
+   it depends on. It may process sequence s once s is published and every upstream cursor is at
+   least s. Stages with the same dependencies run in parallel over the same events (multicast).
+3. A producer may reuse a slot only once every stage nobody depends on (the end of the pipeline)
+   has gone past it.
+4. Handlers get a T& into the ring, so events move between stages without a copy or an allocation.
+   A stage handles everything available in one go and publishes its cursor once per batch.
+5. Whoever runs out of work parks on one EventCount shared by the ring, and the side that makes
+   progress only pays for a wake when somebody is parked.
+*/
+
+struct alignas(64) Sequence {
+    atomic<long> value;
+
+    Sequence() : value(-1) {}
+};
+
+template <typename T>
+class Disruptor {
+    public:
+
+    // handler(event, sequence, end_of_batch)
+    using Handler = function<void(T&, long, bool)>;
+
+    class Stage {
+        friend class Disruptor;
+
+        Handler handler_;
+        vector<Stage*> deps_;
+        Sequence cursor_;
+        bool is_dependency_;
+
+        Stage(Handler handler, vector<Stage*> deps) : handler_(handler), deps_(deps), is_dependency_(false) {}
+
+        public:
+
+        long cursor() {
+            return cursor_.value.load(memory_order_acquire);
+        }
+    };
+
+    private:
+
+    const long size_;
+    const long mask_;
+    unique_ptr<T[]> events_;
+    unique_ptr<atomic<long>[]> published_;
+
+    alignas(64) atomic<long> claim_;
+    alignas(64) atomic<bool> halted_;
+    EventCount signal_;
+
+    vector<unique_ptr<Stage> > stages_;
+    vector<Stage*> gating_;
+    vector<thread> threads_;
+
+    // Runs first in the initializer list, so a bad size throws before anything is allocated.
+    static long checkedSize(long size) {
+        if (size <= 0 || (size & (size - 1)) != 0) {
+            throw std::invalid_argument("Ring size must be a power of two");
+        }
+        return size;
+    }
+
+    long minGating() {
+        long min_seq = LONG_MAX;
+        for (Stage* stage : gating_) {
+            min_seq = min(min_seq, stage->cursor());
+        }
+        return min_seq;
+    }
+
+    // Highest sequence from next onwards that is published and processed by every dependency.
+    long available(Stage* stage, long next) {
+        long limit = LONG_MAX;
+        for (Stage* dep : stage->deps_) {
+            limit = min(limit, dep->cursor());
+        }
+
+        if (limit == LONG_MAX) {
+            // Depends on the producers only.
+            limit = claim_.load(memory_order_acquire) - 1;
+        }
+
+        long seq = next;
+        while (seq <= limit && published_[seq & mask_].load(memory_order_acquire) == seq) {
+            seq++;
+        }
+        return seq - 1;
+    }
+
+    void run(Stage* stage) {
+        long next = stage->cursor() + 1;
+        while (true) {
+            long avail = next - 1;
+            Await(signal_, [&]() {
+                avail = available(stage, next);
+                return avail >= next || halted_.load(memory_order_acquire);
+            });
+
+            if (avail < next) {
+                // Halted with nothing left to do.
+                break;
+            }
+
+            for (long seq = next; seq <= avail; seq++) {
+                stage->handler_(events_[seq & mask_], seq, seq == avail);
+            }
+            stage->cursor_.value.store(avail, memory_order_release);
+            signal_.NotifyAll();
+            next = avail + 1;
+        }
+    }
+
+    public:
+
+    explicit Disruptor(long size) :
+    size_(checkedSize(size)),
+    mask_(size - 1),
+    events_(new T[size]),
+    published_(new atomic<long>[size]),
+    claim_(0),
+    halted_(false) {
+        for (long i = 0; i < size_; i++) {
+            published_[i].store(-1, memory_order_relaxed);
+        }
+    }
+
+    Disruptor(const Disruptor& other) = delete;
+    Disruptor& operator=(const Disruptor& other) = delete;
+
+    ~Disruptor() {
+        shutdown();
+    }
+
+    // Adds a stage that runs after all of deps, or right after the producers if deps is empty.
+    // Call before start().
+    Stage& addStage(Handler handler, vector<Stage*> deps = {}) {
+        stages_.push_back(unique_ptr<Stage>(new Stage(handler, deps)));
+        for (Stage* dep : deps) {
+            dep->is_dependency_ = true;
+        }
+        return *stages_.back();
+    }
+
+    void start() {
+        for (auto& stage : stages_) {
+            if (!stage->is_dependency_) {
+                gating_.push_back(stage.get());
+            }
+        }
+        for (auto& stage : stages_) {
+            threads_.push_back(thread(&Disruptor::run, this, stage.get()));
+        }
+    }
+
+    // Claims the next slot, lets fill write the event in place and publishes it. Blocks while the
+    // ring is full.
+    template <typename Fill>
+    long publish(Fill fill) {
+        long seq = claim_.fetch_add(1, memory_order_acq_rel);
+        if (seq - size_ > minGating()) {
+            Await(signal_, [&]() { return seq - size_ <= minGating(); });
+        }
+
+        fill(events_[seq & mask_]);
+        published_[seq & mask_].store(seq, memory_order_release);
+        signal_.NotifyAll();
+        return seq;
+    }
+
+    // Lets the stages finish every published event, then stops them.
+    void shutdown() {
+        if (threads_.empty()) {
+            return;
+        }
+
+        long last = claim_.load() - 1;
+        Await(signal_, [&]() { return minGating() >= last; });
+        halted_.store(true, memory_order_release);
+        signal_.NotifyAll();
+        for (auto& t : threads_) {
+            t.join();
+        }
+        threads_.clear();
+    }
+};
+
+struct IngestEvent {
+    long raw;
+    long decoded;
+    long enriched;
+    long audited;
+};
+
+// decode -> enrich -> persist, plus an audit stage that reads the same decoded events in parallel
+// with enrich, and persist depending on both.
+void testPipeline() {
+    Disruptor<IngestEvent> ring(64);
+    atomic<long> persisted_sum(0);
+    atomic<long> persisted(0);
+
+    auto& decode = ring.addStage([](IngestEvent& e, long, bool) {
+        e.decoded = e.raw * 2;
+    });
+    auto& enrich = ring.addStage([](IngestEvent& e, long, bool) {
+        e.enriched = e.decoded + 1;
+    }, {&decode});
+    auto& audit = ring.addStage([](IngestEvent& e, long, bool) {
+        e.audited = e.decoded;
+    }, {&decode});
+    ring.addStage([&](IngestEvent& e, long, bool) {
+        assert(e.enriched == e.raw * 2 + 1);
+        assert(e.audited == e.raw * 2);
+        persisted_sum += e.enriched;
+        persisted++;
+    }, {&enrich, &audit});
+    ring.start();
+
+    const int producers = 3;
+    const long per_producer = 20000;
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&ring, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                ring.publish([i](IngestEvent& e) { e.raw = i; });
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ring.shutdown();
+
+    assert(persisted == producers * per_producer);
+    assert(persisted_sum == producers * (per_producer * (per_producer - 1) + per_producer));
+    cout << "Pipeline test passed" << endl;
+}
+
+// Counts constructions, to check a rejected size allocates no events.
+struct CountedEvent {
+    static int constructed;
+
+    CountedEvent() {
+        constructed++;
+    }
+};
+
+int CountedEvent::constructed = 0;
+
+void testBadSize() {
+    for (long size : {0L, -4L, 3L, 100L}) {
+        bool threw = false;
+        try {
+            Disruptor<CountedEvent> ring(size);
+        } catch (const invalid_argument&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+    assert(CountedEvent::constructed == 0);
+    cout << "Bad size test passed" << endl;
+}
+
+void bench() {
+    Disruptor<IngestEvent> ring(1024);
+    auto& decode = ring.addStage([](IngestEvent& e, long, bool) { e.decoded = e.raw * 2; });
+    auto& enrich = ring.addStage([](IngestEvent& e, long, bool) { e.enriched = e.decoded + 1; }, {&decode});
+    long sum = 0;
+    ring.addStage([&sum](IngestEvent& e, long, bool) { sum += e.enriched; }, {&enrich});
+    ring.start();
+
+    const long n = 5000000;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < n; i++) {
+        ring.publish([i](IngestEvent& e) { e.raw = i; });
+    }
+    ring.shutdown();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "3 stages: " << (n / secs / 1e6) << " M events/s" << endl;
+}
+
+int main() {
+    testPipeline();
+    testBadSize();
+    bench();
+}
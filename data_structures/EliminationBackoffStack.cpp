@@ -0,0 +1,342 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cassert>
+
+#include "LockFreeStack.h"
+#include "ThreadSafeStack.h"
+
+using namespace std;
+
+/*
+Elimination backoff stack (Hendler, Shavit, Yerushalmi).
+
+In LockFreeStack every operation is a CAS on the same top word, and under contention most of them
+fail and retry. But a Push and a Pop that run at the same time cancel out: the popper can take the
+pusher's value and the stack never needs to see either of them. So when a CAS on the top fails,
+instead of retrying straight away the thread goes to a random slot of an elimination array:
+
+1. A pusher offers its node in an empty slot and watches it for a while. If a popper marks the slot
+   taken, the push is done. Otherwise it withdraws the offer and tries the top again.
+2. A popper looks at a random slot for a while, and if it finds an offer it swaps it for the taken
+   mark and owns the node.
+
+Both sides meet in different slots, so the more threads contend, the more pairs eliminate away
+from the top. The value is read only after the popper owns the node, so an offer that was withdrawn
+and made again with another value is still a valid exchange.
+
+Nodes and the tagged top are the ones of LockFreeStack, interface as ThreadSafeStack.
+*/
+
+// The elimination array on its own, a pusher and a popper that land in the same slot exchange a
+// node through it.
+template <typename Node>
+class EliminationArray {
+    struct alignas(64) Slot {
+        atomic<Node*> offer;
+
+        Slot() : offer(nullptr) {}
+    };
+
+    const size_t n_slots_;
+    unique_ptr<Slot[]> slots_;
+    const int spins_;
+    atomic<long> exchanged_;
+
+    static Node* taken() {
+        return reinterpret_cast<Node*>(uintptr_t(1));
+    }
+
+    Slot& randomSlot() {
+        thread_local minstd_rand rng(hash<thread::id> {} (this_thread::get_id()));
+        return slots_[rng() % n_slots_];
+    }
+
+    public:
+
+    EliminationArray(size_t slots, int spins) :
+    n_slots_(max<size_t>(slots, 1)),
+    slots_(new Slot[n_slots_]),
+    spins_(spins),
+    exchanged_(0) {}
+
+    // Offers node to a popper for up to spins_ polls. Returns true if a popper took it.
+    bool offer(Node* node) {
+        Slot& slot = randomSlot();
+        Node* expected = nullptr;
+        if (!slot.offer.compare_exchange_strong(expected, node, memory_order_release, memory_order_relaxed)) {
+            return false;
+        }
+
+        for (int i = 0; i < spins_; i++) {
+            if (slot.offer.load(memory_order_acquire) == taken()) {
+                slot.offer.store(nullptr, memory_order_release);
+                exchanged_.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+        }
+
+        expected = node;
+        if (slot.offer.compare_exchange_strong(expected, nullptr, memory_order_relaxed)) {
+            return false;
+        }
+        // A popper took it between the last poll and the withdrawal.
+        slot.offer.store(nullptr, memory_order_release);
+        exchanged_.fetch_add(1, memory_order_relaxed);
+        return true;
+    }
+
+    // Polls a slot up to spins_ times for an offer. Returns the node it took, or nullptr.
+    Node* take() {
+        Slot& slot = randomSlot();
+        for (int i = 0; i < spins_; i++) {
+            Node* offer = slot.offer.load(memory_order_acquire);
+            if (offer == nullptr || offer == taken()) {
+                continue;
+            }
+            if (slot.offer.compare_exchange_strong(offer, taken(), memory_order_acquire, memory_order_relaxed)) {
+                return offer;
+            }
+        }
+        return nullptr;
+    }
+
+    long exchanged() {
+        return exchanged_.load(memory_order_relaxed);
+    }
+};
+
+template <typename T>
+class EliminationBackoffStack {
+    using Node = StackNode<T>;
+
+    TaggedList<T> stack_;
+    TaggedList<T> free_;
+    EliminationArray<Node> elimination_;
+    EventCount st_not_empty_;
+
+    template <typename U>
+    using IfNothrowMove = typename enable_if<is_nothrow_move_constructible<U>::value, int>::type;
+
+    Node* popNode() {
+        while (true) {
+            Node* node;
+            switch (stack_.tryPop(node)) {
+                case TaggedList<T>::kDone:
+                    return node;
+                case TaggedList<T>::kEmpty:
+                    return nullptr;
+                case TaggedList<T>::kContended:
+                    break;
+            }
+            if ((node = elimination_.take())) {
+                return node;
+            }
+        }
+    }
+
+    // Pops a node and hands its value to take. If take throws the node goes back on the stack.
+    template <typename Take>
+    bool popWith(Take take) {
+        Node* node = popNode();
+        if (!node) {
+            return false;
+        }
+        try {
+            take(*node->value);
+        } catch (...) {
+            stack_.push(node);
+            throw;
+        }
+        node->value.reset();
+        free_.push(node);
+        return true;
+    }
+
+    public:
+
+    explicit EliminationBackoffStack(size_t slots = max(thread::hardware_concurrency() / 2, 1u), int spins = 64) :
+    elimination_(slots, spins) {}
+
+    EliminationBackoffStack(const EliminationBackoffStack& other) = delete;
+    EliminationBackoffStack& operator=(const EliminationBackoffStack&) = delete;
+
+    ~EliminationBackoffStack() {
+        stack_.deleteAll();
+        free_.deleteAll();
+    }
+
+    void Push(T value) {
+        Node* node = free_.pop();
+        if (!node) {
+            node = new Node();
+        }
+        try {
+            node->value.emplace(std::move(value));
+        } catch (...) {
+            free_.push(node);
+            throw;
+        }
+
+        while (!stack_.tryPush(node)) {
+            if (elimination_.offer(node)) {
+                // Handed to a running popper, nobody parked needs waking for it.
+                return;
+            }
+        }
+        st_not_empty_.NotifyOne();
+    }
+
+    shared_ptr<T> Pop() {
+        shared_ptr<T> val;
+        popWith([&](T& top) { val = make_shared<T>(std::move_if_noexcept(top)); });
+        return val;
+    }
+
+    void Pop(T& value) {
+        if (!popWith([&](T& top) { value = std::move_if_noexcept(top); })) {
+            throw std::exception();
+        }
+    }
+
+    void WaitAndPop(T& value) {
+        Await(st_not_empty_, [&]() { return popWith([&](T& top) { value = std::move_if_noexcept(top); }); });
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    optional<T> TryPopValue() {
+        optional<T> val;
+        popWith([&](T& top) { val.emplace(std::move(top)); });
+        return val;
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    T WaitAndPopValue() {
+        optional<T> val;
+        Await(st_not_empty_, [&]() { return popWith([&](T& top) { val.emplace(std::move(top)); }); });
+        return std::move(*val);
+    }
+
+    bool empty() {
+        return stack_.empty();
+    }
+
+    // Push / Pop pairs that met in the elimination array.
+    long eliminated() {
+        return elimination_.exchanged();
+    }
+};
+
+void testSequential() {
+    EliminationBackoffStack<string> st;
+    st.Push("a");
+    st.Push("b");
+    st.Push("c");
+
+    optional<string> top = st.TryPopValue();
+    assert(*top == "c");
+    string next = st.WaitAndPopValue();
+    assert(next == "b");
+    shared_ptr<string> last = st.Pop();
+    assert(*last == "a");
+    last = st.Pop();
+    assert(!last);
+    assert(st.empty());
+    cout << "Sequential test passed" << endl;
+}
+
+// One slot and long polls, so a pusher and a popper always meet.
+void testExchange() {
+    EliminationArray<StackNode<int> > elimination(1, 1 << 30);
+    StackNode<int> node;
+    node.value.emplace(42);
+
+    thread popper([&elimination, &node]() {
+        StackNode<int>* got;
+        while (!(got = elimination.take())) {}
+        assert(got == &node && *got->value == 42);
+    });
+    bool exchanged = elimination.offer(&node);
+    assert(exchanged);
+    popper.join();
+    assert(elimination.exchanged() == 1);
+
+    EliminationArray<StackNode<int> > idle(1, 100);
+    exchanged = idle.offer(&node);
+    assert(!exchanged);
+    StackNode<int>* taken = idle.take();
+    assert(!taken);
+    cout << "Exchange test passed" << endl;
+}
+
+// Push / pop pairs from many threads on one elimination slot. Nothing may be lost or duplicated.
+void testConcurrent() {
+    EliminationBackoffStack<long> st(1, 1000);
+    const int threads = 8;
+    const long per_thread = 100000;
+    vector<atomic<int> > seen(threads * per_thread);
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            for (long i = 0; i < per_thread; i++) {
+                st.Push(t * per_thread + i);
+                long v;
+                st.WaitAndPop(v);
+                seen[v]++;
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    assert(st.empty());
+    for (auto& count : seen) {
+        assert(count == 1);
+    }
+    cout << "Concurrent test passed, " << st.eliminated() << " eliminated pairs" << endl;
+}
+
+template <typename Stack>
+void bench(const string& name, Stack& st, int threads) {
+    const long ops = 1000000;
+    long per_thread = ops / threads;
+
+    vector<thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&st, per_thread]() {
+            for (long i = 0; i < per_thread; i++) {
+                st.Push(i);
+                st.TryPopValue();
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << name << ", " << threads << " threads: " << (2 * per_thread * threads / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testSequential();
+    testExchange();
+    testConcurrent();
+    for (int threads : {1, 4, 16, 64}) {
+        ThreadSafeStack<long> locked;
+        bench("mutex", locked, threads);
+        LockFreeStack<long> treiber;
+        bench("treiber", treiber, threads);
+        EliminationBackoffStack<long> elimination(max(threads / 2, 1));
+        bench("elimination", elimination, threads);
+    }
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <stdexcept>
+
+/*
+Epoch based reclamation (Fraser).
+
+Readers that walk a structure without locks announce that they are inside it, writers that unlink a
+node hand it to retire() instead of deleting it:
+
+1. There is a global epoch. A reader entering (EpochGuard) copies it into its per-thread record and
+   clears the record again when it leaves. Announcing is a store to a line that only this thread
+   writes, so readers do not bounce anything between cores.
+2. retire() puts the node on a thread local list tagged with the global epoch at that point.
+3. The global epoch only moves from e to e + 1 once every thread inside a structure has announced
+   e. So once it reached e + 2, every reader that could have seen a node retired in e has left, and
+   the node is freed.
+
+Compared to the hazard pointers in LockFreeQueue.cpp a reader publishes once per operation, not
+once per node it visits, which suits walking a chain. The price is that one reader stuck inside a
+guard holds back all reclamation.
+
+Guards nest. A thread that exits hands its unfreed nodes to a shared list, the next collection
+frees them.
+*/
+namespace epoch {
+
+const unsigned kMaxThreads = 512;
+// Retired nodes a thread collects before it tries to move the epoch on.
+const size_t kCollectThreshold = 64;
+
+struct alignas(64) Record {
+    std::atomic<bool> used;
+    // 0 while outside any guard.
+    std::atomic<uint64_t> epoch;
+};
+
+struct Retired {
+    void* p;
+    void (*deleter)(void*);
+    uint64_t epoch;
+};
+
+inline Record records[kMaxThreads];
+inline std::atomic<uint64_t> global_epoch(1);
+// One past the highest record ever claimed. Records are claimed from the front, so scanning up to
+// here instead of kMaxThreads covers every thread that can be inside a guard.
+inline std::atomic<unsigned> high_water(0);
+inline std::mutex orphans_mt;
+inline std::vector<Retired> orphans;
+
+// Moves the epoch on if every thread inside a guard has seen the current one.
+inline uint64_t tryAdvance() {
+    uint64_t current = global_epoch.load();
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    unsigned n = high_water.load();
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t e = records[i].epoch.load(std::memory_order_acquire);
+        if (e != 0 && e != current) {
+            return current;
+        }
+    }
+    global_epoch.compare_exchange_strong(current, current + 1);
+    return global_epoch.load();
+}
+
+// Frees the entries of list that are two epochs old.
+inline void freeExpired(std::vector<Retired>& list, uint64_t now) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].epoch + 2 <= now) {
+            list[i].deleter(list[i].p);
+        } else {
+            list[kept++] = list[i];
+        }
+    }
+    list.resize(kept);
+}
+
+class ThreadState {
+    Record* rec_;
+
+    public:
+
+    std::vector<Retired> limbo;
+    int nesting;
+
+    ThreadState() : rec_(nullptr), nesting(0) {
+        for (unsigned i = 0; i < kMaxThreads; i++) {
+            bool expected = false;
+            if (!records[i].used.load() && records[i].used.compare_exchange_strong(expected, true)) {
+                rec_ = &records[i];
+                // Raised before this thread can announce an epoch, so a scan that misses it also
+                // misses the announcement, the same race as with a record scanned too early.
+                unsigned hw = high_water.load();
+                while (hw < i + 1 && !high_water.compare_exchange_weak(hw, i + 1)) {
+                }
+                break;
+            }
+        }
+        if (!rec_) {
+            throw std::runtime_error("No epoch records available");
+        }
+    }
+
+    // Tries to free what it can first, so the last thread to exit (with nobody left inside a guard)
+    // leaves nothing behind.
+    ~ThreadState() {
+        rec_->epoch.store(0);
+        uint64_t now = tryAdvance();
+        now = tryAdvance();
+        freeExpired(limbo, now);
+        {
+            std::lock_guard<std::mutex> lk(orphans_mt);
+            freeExpired(orphans, now);
+            orphans.insert(orphans.end(), limbo.begin(), limbo.end());
+        }
+        rec_->used.store(false);
+    }
+
+    Record& record() {
+        return *rec_;
+    }
+};
+
+inline ThreadState& local() {
+    thread_local ThreadState state;
+    return state;
+}
+
+inline void collect() {
+    ThreadState& st = local();
+    uint64_t now = tryAdvance();
+    freeExpired(st.limbo, now);
+
+    std::unique_lock<std::mutex> lk(orphans_mt, std::try_to_lock);
+    if (lk.owns_lock() && !orphans.empty()) {
+        freeExpired(orphans, now);
+    }
+}
+
+template <typename T>
+void retire(T* p) {
+    ThreadState& st = local();
+    // The caller's unlink has to be visible before the epoch is read, or the tag could predate the
+    // unlink and a reader that entered in between would still be on a node freed under it.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    st.limbo.push_back({p, [](void* q) { delete static_cast<T*>(q); }, global_epoch.load()});
+    if (st.limbo.size() >= kCollectThreshold) {
+        collect();
+    }
+}
+
+}  // namespace epoch
+
+// Keeps every node this thread can reach alive until it goes out of scope.
+class EpochGuard {
+    epoch::ThreadState& st_;
+
+    public:
+
+    EpochGuard() : st_(epoch::local()) {
+        if (st_.nesting++ > 0) {
+            return;
+        }
+        std::atomic<uint64_t>& mine = st_.record().epoch;
+        uint64_t e = epoch::global_epoch.load();
+        while (true) {
+            // seq_cst store then seq_cst load, so either this load sees a newer epoch or tryAdvance
+            // sees our announcement. The epoch may have moved on before the store, announce again.
+            mine.store(e);
+            uint64_t now = epoch::global_epoch.load();
+            if (now == e) {
+                break;
+            }
+            e = now;
+        }
+    }
+
+    EpochGuard(const EpochGuard& other) = delete;
+    EpochGuard& operator=(const EpochGuard& other) = delete;
+
+    ~EpochGuard() {
+        if (--st_.nesting == 0) {
+            st_.record().epoch.store(0, std::memory_order_release);
+        }
+    }
+};
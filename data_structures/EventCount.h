@@ -0,0 +1,139 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+Eventcount on top of a Linux futex.
+
+A condition variable needs the waiter and the notifier to share a mutex, and notify_one is paid on
+every state change even when nobody waits. An eventcount lets the data structure keep its own
+(possibly lock-free) state and only pays for a syscall when a thread is actually parked:
+
+    Waiter                                  Notifier
+    ------                                  --------
+    if (try_op()) return;                   change state
+    key = ec.PrepareWait();                 ec.Notify();   // just a load if nobody waits
+    if (try_op()) { ec.CancelWait(); return; }
+    ec.Wait(key);
+
+PrepareWait announces the waiter before it re-checks the condition, and Notify looks for waiters
+only after the state change, with a full fence on both sides. So either the re-check sees the new
+state, or Notify sees the waiter and bumps the epoch, which makes the futex wait return.
+*/
+class EventCount {
+    std::atomic<uint32_t> epoch_;
+    std::atomic<uint32_t> waiters_;
+
+    static void futex_wait(std::atomic<uint32_t>* addr, uint32_t expected) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+    }
+
+    static void futex_wait_for(std::atomic<uint32_t>* addr, uint32_t expected, std::chrono::nanoseconds timeout) {
+        timespec ts;
+        ts.tv_sec = timeout.count() / 1000000000;
+        ts.tv_nsec = timeout.count() % 1000000000;
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<uint32_t>* addr, int count) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+    public:
+
+    EventCount() : epoch_(0), waiters_(0) {}
+    EventCount(const EventCount& other) = delete;
+    EventCount& operator=(const EventCount& other) = delete;
+
+    uint32_t PrepareWait() {
+        waiters_.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return epoch_.load(std::memory_order_acquire);
+    }
+
+    void CancelWait() {
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void Wait(uint32_t key) {
+        while (epoch_.load(std::memory_order_acquire) == key) {
+            futex_wait(&epoch_, key);
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // Returns false if the deadline passed without a notification.
+    bool WaitUntil(uint32_t key, std::chrono::steady_clock::time_point deadline) {
+        bool notified = true;
+        while (epoch_.load(std::memory_order_acquire) == key) {
+            auto left = deadline - std::chrono::steady_clock::now();
+            if (left <= std::chrono::steady_clock::duration::zero()) {
+                notified = false;
+                break;
+            }
+            futex_wait_for(&epoch_, key, std::chrono::duration_cast<std::chrono::nanoseconds>(left));
+        }
+        waiters_.fetch_sub(1, std::memory_order_relaxed);
+        return notified;
+    }
+
+    void NotifyOne() {
+        notify(1);
+    }
+
+    void NotifyAll() {
+        notify(INT_MAX);
+    }
+
+    bool HasWaiters() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return waiters_.load(std::memory_order_relaxed) != 0;
+    }
+
+    private:
+
+    void notify(int count) {
+        if (!HasWaiters()) {
+            return;
+        }
+        epoch_.fetch_add(1, std::memory_order_release);
+        futex_wake(&epoch_, count);
+    }
+};
+
+// Retries try_op until it succeeds, parking on ec whenever it fails.
+template <typename TryOp>
+void Await(EventCount& ec, TryOp try_op) {
+    while (!try_op()) {
+        uint32_t key = ec.PrepareWait();
+        if (try_op()) {
+            ec.CancelWait();
+            return;
+        }
+        ec.Wait(key);
+    }
+}
+
+// Same as Await, gives up at deadline. Returns whether try_op succeeded.
+template <typename TryOp>
+bool AwaitUntil(EventCount& ec, TryOp try_op, std::chrono::steady_clock::time_point deadline) {
+    while (!try_op()) {
+        uint32_t key = ec.PrepareWait();
+        if (try_op()) {
+            ec.CancelWait();
+            return true;
+        }
+        if (!ec.WaitUntil(key, deadline)) {
+            return try_op();
+        }
+    }
+    return true;
+}
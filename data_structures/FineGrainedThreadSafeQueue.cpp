@@ -6,6 +6,16 @@
 #include <memory>
 #include <exception>
 #include <queue>
+#include <atomic>
+#include <optional>
+#include <type_traits>
+#include <cstdlib>
+#include <cassert>
+#include <vector>
+#include <chrono>
+#include <stdexcept>
+
+#include "EventCount.h"
 
 using namespace std;
 
@@ -197,13 +207,29 @@ void WaitAndPop(T& val) {
 Somewhere down the line, we would copy data to val, which can CREATE AN EXCEPTION
 HENCE EXCEPTION SAFETY CAN BE COMPRIMISED.
 
+UNLESS moving a T can not throw. Then the node can hold the T itself (optional<T>, the dummy has
+none), and the value can be moved to the caller after the node is unlinked without any risk. So when
+T is nothrow move constructible:
+   a. data is stored inline, Push does one allocation (the node) instead of two.
+   b. TryPopValue / WaitAndPopValue (optional<T> / T) and TryPop(T&) / WaitAndPop(T&) are available
+      and allocate nothing.
+   c. The shared_ptr pops still work, they make_shared before the node is unlinked, so a bad_alloc
+      leaves the queue untouched.
+Otherwise the node keeps a shared_ptr<T> exactly as before and only the shared_ptr pops exist.
+
 */
 
 template <typename T>
 class ThreadSafeQueue {
 private:
+    static constexpr bool kStoreByValue = is_nothrow_move_constructible<T>::value;
+    using Stored = typename conditional<kStoreByValue, optional<T>, shared_ptr<T> >::type;
+
+    template <typename U>
+    using IfByValue = typename enable_if<is_nothrow_move_constructible<U>::value, int>::type;
+
     struct Node {
-        shared_ptr<T> data;
+        Stored data;
         unique_ptr<Node> next;
     };
 
@@ -216,7 +242,7 @@ private:
     int sz_;
     mutex sz_mt_;
 
-    condition_variable cnd_;
+    EventCount not_empty_;
 
     Node* getTail() {
         lock_guard<mutex> lk(tail_mt_);
@@ -228,6 +254,62 @@ private:
         sz_ += add;
     }
 
+    // Call holding lk on head_mt_. Returns with lk held and an element present, or false if the
+    // deadline passed first. Push updates tail_ under tail_mt_ before notifying and we re-check
+    // tail_ after announcing ourselves, so a push can not slip in between the check and the wait.
+    bool waitForData(unique_lock<mutex>& lk, const chrono::steady_clock::time_point* deadline = nullptr) {
+        while (head_.get() == getTail()) {
+            uint32_t key = not_empty_.PrepareWait();
+            if (head_.get() != getTail()) {
+                not_empty_.CancelWait();
+                break;
+            }
+            lk.unlock();
+            bool notified = true;
+            if (deadline) {
+                notified = not_empty_.WaitUntil(key, *deadline);
+            } else {
+                not_empty_.Wait(key);
+            }
+            lk.lock();
+            if (!notified) {
+                return head_.get() != getTail();
+            }
+        }
+        return true;
+    }
+
+    static Stored wrap(T val) {
+        if constexpr (kStoreByValue) {
+            return Stored(std::move(val));
+        } else {
+            return make_shared<T>(std::move(val));
+        }
+    }
+
+    static shared_ptr<T> share(Stored& data) {
+        if constexpr (kStoreByValue) {
+            return make_shared<T>(std::move(*data));
+        } else {
+            return data;
+        }
+    }
+
+    // Undoes share when the shared_ptr could not be handed out. Moving T back can not throw.
+    static void unshare(Stored& data, shared_ptr<T>& item) {
+        if constexpr (kStoreByValue) {
+            data.emplace(std::move(*item));
+        }
+    }
+
+    // Call holding head_mt_ with at least one element present.
+    unique_ptr<Node> unlinkHead() {
+        updateSize(-1);
+        unique_ptr<Node> old = std::move(head_);
+        head_ = std::move(old->next);
+        return old;
+    }
+
     public:
 
     ThreadSafeQueue() : head_(new Node()), tail_(head_.get()), sz_(0) {}
@@ -247,43 +329,345 @@ private:
             return shared_ptr<T>();
         }
 
-        updateSize(-1);
-        shared_ptr<T> result = head_->data;
-        unique_ptr<Node> old = std::move(head_);
-        head_ = move(old->next);
+        shared_ptr<T> result = share(head_->data);
+        unlinkHead();
         return result;
     }
 
     void Push(T new_val) {
-        shared_ptr<T> data_ptr = make_shared<T>(new_val);
+        Stored data = wrap(std::move(new_val));
         unique_ptr<Node> new_dummy = make_unique<Node>();
         Node* new_tail = new_dummy.get();
         {
             lock_guard<mutex> lk(tail_mt_);
-            tail_->data = data_ptr;
+            tail_->data = std::move(data);
             tail_->next = std::move(new_dummy);
             tail_ = new_tail;
         }
         updateSize(1);
-        cnd_.notify_one();
+        not_empty_.NotifyOne();
     }
 
     shared_ptr<T> WaitAndPop() {
         unique_lock<mutex> lk(head_mt_);
-        cnd_.wait(lk, [this] () { return head_.get() != getTail();});
-        updateSize(-1);
-        shared_ptr<T> result = head_->data;
-        unique_ptr<Node> old = std::move(head_);
-        head_ = std::move(old->next);
+        waitForData(lk);
+        shared_ptr<T> result = share(head_->data);
+        unlinkHead();
         return result;
     }
 
+    template <typename U = T, IfByValue<U> = 0>
+    optional<T> TryPopValue() {
+        unique_ptr<Node> old;
+        {
+            lock_guard<mutex> lk(head_mt_);
+            if (head_.get() == getTail()) {
+                return nullopt;
+            }
+            old = unlinkHead();
+        }
+        return std::move(old->data);
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    bool TryPop(T& val) {
+        optional<T> res = TryPopValue();
+        if (!res) {
+            return false;
+        }
+        val = std::move(*res);
+        return true;
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    T WaitAndPopValue() {
+        unique_ptr<Node> old;
+        {
+            unique_lock<mutex> lk(head_mt_);
+            waitForData(lk);
+            old = unlinkHead();
+        }
+        return std::move(*old->data);
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    void WaitAndPop(T& val) {
+        val = WaitAndPopValue();
+    }
+
+    /*
+    The new nodes are built and chained outside the lock: the first value goes into the current
+    dummy, value i goes into new node i, and the last new node becomes the dummy. Under tail_mt_
+    only the first value and the links are updated, so the critical section is O(1) whatever the
+    batch size. Same exception argument as Push, nothing shared is touched until all allocations
+    succeeded.
+    */
+    template <typename Range>
+    void PushBulk(const Range& range) {
+        vector<Stored> items;
+        for (const auto& val : range) {
+            items.push_back(wrap(val));
+        }
+        if (items.empty()) {
+            return;
+        }
+
+        unique_ptr<Node> chain = make_unique<Node>();
+        Node* last = chain.get();
+        for (size_t i = 1; i < items.size(); i++) {
+            last->data = std::move(items[i]);
+            last->next = make_unique<Node>();
+            last = last->next.get();
+        }
+
+        {
+            lock_guard<mutex> lk(tail_mt_);
+            tail_->data = std::move(items[0]);
+            tail_->next = std::move(chain);
+            tail_ = last;
+        }
+        updateSize(items.size());
+
+        if (items.size() == 1) {
+            not_empty_.NotifyOne();
+        } else {
+            not_empty_.NotifyAll();
+        }
+    }
+
+    // Waits up to duration_ms for an element, then unlinks up to max_n nodes in one critical
+    // section. The unlinked nodes are freed after head_mt_ is released.
+    template <typename OutputIt>
+    size_t PopBulk(OutputIt out, size_t max_n, int duration_ms) {
+        if (max_n == 0) {
+            return 0;
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(duration_ms);
+        unique_ptr<Node> popped;
+        size_t n = 0;
+        {
+            unique_lock<mutex> lk(head_mt_);
+            if (!waitForData(lk, &deadline)) {
+                return 0;
+            }
+
+            Node* cur_tail = getTail();
+            Node* last = nullptr;
+            try {
+                for (Node* cur = head_.get(); cur != cur_tail && n < max_n; cur = cur->next.get()) {
+                    shared_ptr<T> item = share(cur->data);
+                    try {
+                        *out++ = item;
+                    } catch (...) {
+                        unshare(cur->data, item);
+                        throw;
+                    }
+                    last = cur;
+                    n++;
+                }
+            } catch (...) {
+                // share fails before touching the node, a failed write puts the value back. Either
+                // way cur stays queued, only the ones already handed out come off the queue.
+                if (last) {
+                    popped = std::move(head_);
+                    head_ = std::move(last->next);
+                    updateSize(-static_cast<int>(n));
+                }
+                throw;
+            }
+
+            popped = std::move(head_);
+            head_ = std::move(last->next);
+            updateSize(-static_cast<int>(n));
+        }
+
+        // Iteratively, a long chain of unique_ptr would otherwise recurse once per node.
+        while (popped) {
+            popped = std::move(popped->next);
+        }
+        return n;
+    }
+
     int sz() {
         lock_guard<mutex> lk(sz_mt_);
         return sz_;
     }
 };
 
+/*
+
+Pooled variant of ThreadSafeQueue.
+
+ThreadSafeQueue pays two allocations per Push (make_shared for the data, make_unique for the new
+dummy) and two frees per pop. Here:
+
+1. The value is stored inline in the node (optional<T>), so there is no separate data allocation.
+2. Popped nodes go to a per-queue free list and Push takes its new dummy from there. Once the free
+   list holds as many nodes as the queue's high water mark, push/pop allocate nothing.
+
+The free list is a Treiber stack. Nodes are taken from it only while holding tail_mt_, so there is
+a single popper at any time and no ABA problem. Nodes are returned to it after head_mt_ is released,
+with a plain CAS.
+
+Exception safety:
+   The value is handed out through a T& instead of a shared_ptr<T>, which the analysis of
+   ThreadSafeQueue warns about: the copy into val could throw after the node was unlinked. Here the
+   value is moved, and T is required to be nothrow move constructible/assignable, so nothing can
+   throw once the queue has been modified. In Push the value is emplaced into the dummy before any
+   link is changed, if that throws the spare node simply goes back to the free list.
+*/
+template <typename T>
+class PooledThreadSafeQueue {
+    static_assert(std::is_nothrow_move_constructible<T>::value && std::is_nothrow_move_assignable<T>::value,
+                  "PooledThreadSafeQueue hands values out by move and needs it not to throw");
+
+private:
+    struct Node {
+        optional<T> data;
+        Node* next;
+
+        Node() : next(nullptr) {}
+    };
+
+    Node* head_;
+    mutex head_mt_;
+
+    Node* tail_;
+    mutex tail_mt_;
+
+    atomic<Node*> free_;
+    atomic<int> sz_;
+
+    EventCount not_empty_;
+
+    Node* getTail() {
+        lock_guard<mutex> lk(tail_mt_);
+        return tail_;
+    }
+
+    // Same as ThreadSafeQueue::waitForData.
+    bool waitForData(unique_lock<mutex>& lk, const chrono::steady_clock::time_point* deadline = nullptr) {
+        while (head_ == getTail()) {
+            uint32_t key = not_empty_.PrepareWait();
+            if (head_ != getTail()) {
+                not_empty_.CancelWait();
+                break;
+            }
+            lk.unlock();
+            bool notified = true;
+            if (deadline) {
+                notified = not_empty_.WaitUntil(key, *deadline);
+            } else {
+                not_empty_.Wait(key);
+            }
+            lk.lock();
+            if (!notified) {
+                return head_ != getTail();
+            }
+        }
+        return true;
+    }
+
+    // Call holding tail_mt_, which makes this thread the only popper of free_.
+    Node* getFreeNode() {
+        Node* node = free_.load(memory_order_acquire);
+        while (node && !free_.compare_exchange_weak(node, node->next, memory_order_acquire)) {}
+        if (!node) {
+            return new Node();
+        }
+        node->next = nullptr;
+        return node;
+    }
+
+    void releaseNode(Node* node) {
+        node->next = free_.load(memory_order_relaxed);
+        while (!free_.compare_exchange_weak(node->next, node, memory_order_release)) {}
+    }
+
+    // Call holding head_mt_ with at least one element present.
+    Node* popHead(T& value) {
+        Node* old = head_;
+        value = std::move(*old->data);
+        old->data.reset();
+        head_ = old->next;
+        sz_.fetch_sub(1, memory_order_relaxed);
+        return old;
+    }
+
+    public:
+
+    PooledThreadSafeQueue() : head_(new Node()), tail_(head_), free_(nullptr), sz_(0) {}
+    PooledThreadSafeQueue(const PooledThreadSafeQueue& other) = delete;
+    PooledThreadSafeQueue& operator=(const PooledThreadSafeQueue& other) = delete;
+
+    ~PooledThreadSafeQueue() {
+        while (head_) {
+            Node* next = head_->next;
+            delete head_;
+            head_ = next;
+        }
+
+        Node* node = free_.load();
+        while (node) {
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    // Pre-populates the free list so that even the first n pushes do not allocate.
+    void Reserve(int n) {
+        for (int i = 0; i < n; i++) {
+            releaseNode(new Node());
+        }
+    }
+
+    bool TryPop(T& value) {
+        Node* old;
+        {
+            lock_guard<mutex> lk(head_mt_);
+            if (head_ == getTail()) {
+                // Only the dummy node present.
+                return false;
+            }
+            old = popHead(value);
+        }
+        releaseNode(old);
+        return true;
+    }
+
+    void Push(T new_val) {
+        {
+            lock_guard<mutex> lk(tail_mt_);
+            Node* new_dummy = getFreeNode();
+            try {
+                tail_->data.emplace(std::move(new_val));
+            } catch (...) {
+                releaseNode(new_dummy);
+                throw;
+            }
+            tail_->next = new_dummy;
+            tail_ = new_dummy;
+        }
+        sz_.fetch_add(1, memory_order_relaxed);
+        not_empty_.NotifyOne();
+    }
+
+    void WaitAndPop(T& value) {
+        Node* old;
+        {
+            unique_lock<mutex> lk(head_mt_);
+            waitForData(lk);
+            old = popHead(value);
+        }
+        releaseNode(old);
+    }
+
+    int sz() {
+        return sz_.load(memory_order_relaxed);
+    }
+};
+
 template <typename T>
 void runThread(shared_ptr<ThreadSafeQueue<T>> q, int adds, int removs) {
     for (int i = 0; i < adds; i++) {
@@ -314,6 +698,191 @@ void testThreadSafeQueue() {
     cout << "Test passed " << endl;
 }
 
+// Counts heap allocations so the pooled queue test can check that steady state allocates nothing.
+atomic<long> allocations(0);
+
+void* operator new(size_t sz) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    if (void* p = malloc(sz)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+template <typename T>
+void runPooledThread(shared_ptr<PooledThreadSafeQueue<T>> q, int adds, int removs) {
+    for (int i = 0; i < adds; i++) {
+        q->Push(rand() % 10);
+    }
+
+    while (removs--) {
+        T val;
+        q->WaitAndPop(val);
+    }
+}
+
+void testPooledThreadSafeQueue() {
+    auto q = make_shared<PooledThreadSafeQueue<int> > ();
+    int add1 = rand() % 10 + 2;
+    int removs1 = rand() % add1;
+
+    int add2 = rand() % 10 + 2;
+    int removs2 = rand() % 10 % add2;
+
+    thread t1(runPooledThread<int>, q, add1, removs1);
+    thread t2(runPooledThread<int>, q, add2, removs2);
+
+    t1.join();
+    t2.join();
+
+    assert(q->sz() == (add1 + add2 - removs1 - removs2));
+
+    // FIFO order and zero allocations once the free list is warm.
+    PooledThreadSafeQueue<int> pq;
+    pq.Reserve(16);
+    long before = allocations.load();
+    for (int round = 0; round < 1000; round++) {
+        for (int i = 0; i < 16; i++) {
+            pq.Push(i);
+        }
+        for (int i = 0; i < 16; i++) {
+            int val;
+            bool popped = pq.TryPop(val);
+            assert(popped && val == i);
+        }
+    }
+    int val;
+    bool popped = pq.TryPop(val);
+    assert(!popped);
+    assert(allocations.load() == before);
+    cout << "Pooled test passed " << endl;
+}
+
+// Output iterator that collects into out and throws on write number fail_at.
+template <typename T>
+struct FailingInserter {
+    vector<shared_ptr<T> >* out;
+    size_t fail_at;
+
+    FailingInserter& operator*() {
+        return *this;
+    }
+
+    FailingInserter& operator++(int) {
+        return *this;
+    }
+
+    FailingInserter& operator=(const shared_ptr<T>& val) {
+        if (out->size() == fail_at) {
+            throw runtime_error("output full");
+        }
+        out->push_back(val);
+        return *this;
+    }
+};
+
+void testBulk() {
+    ThreadSafeQueue<int> q;
+    vector<int> batch;
+    for (int i = 0; i < 100; i++) {
+        batch.push_back(i);
+    }
+
+    thread producer([&q, &batch]() {
+        for (int round = 0; round < 100; round++) {
+            q.PushBulk(batch);
+        }
+    });
+
+    int expected = 0;
+    int total = 0;
+    vector<shared_ptr<int> > out;
+    while (total < 100 * 100) {
+        out.clear();
+        size_t n = q.PopBulk(back_inserter(out), 64, 1000);
+        assert(n > 0 && n <= 64);
+        for (auto& val : out) {
+            assert(*val == expected);
+            expected = (expected + 1) % 100;
+        }
+        total += n;
+    }
+    producer.join();
+
+    assert(q.sz() == 0);
+    size_t n = q.PopBulk(back_inserter(out), 64, 10);
+    assert(n == 0);
+
+    // Asking for nothing pops nothing, even with data queued.
+    q.PushBulk(batch);
+    out.clear();
+    n = q.PopBulk(back_inserter(out), 0, 10);
+    assert(n == 0 && out.empty() && q.sz() == 100);
+
+    // A write that throws leaves its element queued, the ones written before it are popped.
+    bool threw = false;
+    try {
+        q.PopBulk(FailingInserter<int>{&out, 2}, 10, 10);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw && out.size() == 2 && *out[0] == 0 && *out[1] == 1 && q.sz() == 98);
+    int val;
+    bool popped = q.TryPop(val);
+    assert(popped && val == 2);
+    cout << "Bulk test passed " << endl;
+}
+
+void testValuePop() {
+    ThreadSafeQueue<int> q;
+    for (int i = 0; i < 5; i++) {
+        q.Push(i);
+    }
+
+    long before = allocations.load();
+    optional<int> val = q.TryPopValue();
+    assert(val && *val == 0);
+    int out;
+    bool popped = q.TryPop(out);
+    assert(popped && out == 1);
+    out = q.WaitAndPopValue();
+    assert(out == 2);
+    q.WaitAndPop(out);
+    assert(out == 3);
+    // The value pops only free the node, they never allocate.
+    assert(allocations.load() == before);
+
+    // The shared_ptr interface is still there on the by value storage.
+    shared_ptr<int> shared = q.TryPop();
+    assert(*shared == 4);
+    val = q.TryPopValue();
+    assert(!val);
+    assert(q.sz() == 0);
+
+    // A T whose move may throw keeps the shared_ptr storage and the shared_ptr interface only.
+    struct ThrowingMove {
+        int v;
+        ThrowingMove(int v_) : v(v_) {}
+        ThrowingMove(const ThrowingMove& other) : v(other.v) {}
+    };
+    ThreadSafeQueue<ThrowingMove> tq;
+    tq.Push(ThrowingMove(7));
+    shared_ptr<ThrowingMove> moved = tq.WaitAndPop();
+    assert(moved->v == 7);
+    cout << "Value pop test passed " << endl;
+}
+
 int main() {
     testThreadSafeQueue();
+    testPooledThreadSafeQueue();
+    testBulk();
+    testValuePop();
 }
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <stack>
+#include <queue>
+#include <unordered_map>
+#include <string>
+#include <optional>
+#include <stdexcept>
+#include <chrono>
+#include <cassert>
+
+#include "FlatCombining.h"
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+The coarse locked containers on flat combining. Each is the sequential std container behind
+FlatCombining, with the interface of the class it stands in for:
+FcStack - ThreadSafeStack, FcQueue - ThreadSafeQueue (ThreadSafeQueue.cpp), FcMap - CoarseThreadSafeMap.
+*/
+template <typename T>
+class FcStack {
+    FlatCombining<stack<T> > st_;
+    EventCount st_not_empty_;
+
+    public:
+
+    void Push(T value) {
+        st_.apply([&value](stack<T>& st) { st.push(std::move(value)); });
+        st_not_empty_.NotifyOne();
+    }
+
+    optional<T> TryPopValue() {
+        return st_.apply([](stack<T>& st) {
+            optional<T> val;
+            if (!st.empty()) {
+                val.emplace(std::move(st.top()));
+                st.pop();
+            }
+            return val;
+        });
+    }
+
+    shared_ptr<T> Pop() {
+        optional<T> val = TryPopValue();
+        return val ? make_shared<T>(std::move(*val)) : shared_ptr<T>();
+    }
+
+    void WaitAndPop(T& value) {
+        Await(st_not_empty_, [&]() {
+            optional<T> val = TryPopValue();
+            if (val) {
+                value = std::move(*val);
+            }
+            return val.has_value();
+        });
+    }
+};
+
+template <typename T>
+class FcQueue {
+    FlatCombining<queue<T> > q_;
+    EventCount not_empty_;
+
+    public:
+
+    void Push(T value) {
+        q_.apply([&value](queue<T>& q) { q.push(std::move(value)); });
+        not_empty_.NotifyOne();
+    }
+
+    optional<T> TryPopValue() {
+        return q_.apply([](queue<T>& q) {
+            optional<T> val;
+            if (!q.empty()) {
+                val.emplace(std::move(q.front()));
+                q.pop();
+            }
+            return val;
+        });
+    }
+
+    T WaitAndPopValue() {
+        optional<T> val;
+        Await(not_empty_, [&]() {
+            val = TryPopValue();
+            return val.has_value();
+        });
+        return std::move(*val);
+    }
+};
+
+template <typename KEY, typename VALUE>
+class FcMap {
+    FlatCombining<unordered_map<KEY, VALUE> > mp_;
+
+    public:
+
+    shared_ptr<VALUE> get(KEY key) {
+        return mp_.apply([&key](unordered_map<KEY, VALUE>& mp) {
+            auto it = mp.find(key);
+            return it == mp.end() ? shared_ptr<VALUE>() : make_shared<VALUE>(it->second);
+        });
+    }
+
+    void put(KEY key, VALUE value) {
+        mp_.apply([&](unordered_map<KEY, VALUE>& mp) { mp[key] = std::move(value); });
+    }
+
+    bool deleteKey(KEY key) {
+        return mp_.apply([&key](unordered_map<KEY, VALUE>& mp) { return mp.erase(key) > 0; });
+    }
+};
+
+void testContainers() {
+    FcStack<string> st;
+    st.Push("a");
+    st.Push("b");
+    optional<string> top = st.TryPopValue();
+    assert(*top == "b");
+    shared_ptr<string> popped = st.Pop();
+    assert(*popped == "a");
+    popped = st.Pop();
+    assert(!popped);
+
+    FcQueue<int> q;
+    q.Push(1);
+    q.Push(2);
+    int first = q.WaitAndPopValue();
+    assert(first == 1);
+    optional<int> second = q.TryPopValue();
+    assert(*second == 2);
+    second = q.TryPopValue();
+    assert(!second);
+
+    FcMap<string, int> mp;
+    mp.put("x", 1);
+    mp.put("x", 2);
+    assert(*mp.get("x") == 2);
+    bool deleted = mp.deleteKey("x");
+    assert(deleted);
+    assert(!mp.get("x"));
+    deleted = mp.deleteKey("x");
+    assert(!deleted);
+    cout << "Containers test passed" << endl;
+}
+
+// An exception thrown by an operation reaches the thread that published it, whoever combined it.
+void testException() {
+    FlatCombining<vector<int> > v;
+    bool threw = false;
+    try {
+        v.apply([](vector<int>& vec) { return vec.at(3); });
+    } catch (const out_of_range&) {
+        threw = true;
+    }
+    assert(threw);
+    v.apply([](vector<int>& vec) { vec.push_back(1); });
+    size_t size = v.apply([](vector<int>& vec) { return vec.size(); });
+    assert(size == 1);
+    cout << "Exception test passed" << endl;
+}
+
+void testConcurrent() {
+    FcQueue<long> q;
+    const int producers = 4;
+    const long per_producer = 50000;
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&q, p, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                q.Push(p * per_producer + i);
+            }
+        }));
+    }
+
+    atomic<long> sum(0);
+    for (int c = 0; c < 4; c++) {
+        threads.push_back(thread([&q, &sum, producers, per_producer]() {
+            vector<long> last(producers, -1);
+            long local = 0;
+            for (long i = 0; i < per_producer; i++) {
+                long v = q.WaitAndPopValue();
+                assert(v > last[v / per_producer]);
+                last[v / per_producer] = v;
+                local += v;
+            }
+            sum += local;
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    long n = producers * per_producer;
+    assert(sum == n * (n - 1) / 2);
+    cout << "Concurrent test passed" << endl;
+}
+
+template <typename Adaptor>
+void bench(const string& name, int threads) {
+    Adaptor st;
+    const long ops = 1000000;
+    long per_thread = ops / threads;
+
+    vector<thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&st, per_thread]() {
+            for (long i = 0; i < per_thread; i++) {
+                st.apply([i](stack<long>& s) { s.push(i); });
+                st.apply([](stack<long>& s) {
+                    if (!s.empty()) {
+                        s.pop();
+                    }
+                });
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << name << ", " << threads << " threads: " << (2 * per_thread * threads / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testContainers();
+    testException();
+    testConcurrent();
+    for (int threads : {1, 4, 16, 64}) {
+        bench<Locked<stack<long> > >("mutex", threads);
+        bench<FlatCombining<stack<long> > >("flat combining", threads);
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <optional>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+
+using namespace std;
+
+/*
+Flat combining (Hendler, Incze, Shavit, Tzafrir).
+
+With one mutex around a sequential container every thread drags the lock's cache line and the
+container's lines over to its core, does a few nanoseconds of work and hands them on. Here a thread
+does not take the lock to run its operation, it publishes it:
+
+1. It claims a free publication record (one cache line each, the thread starts probing at its own
+   hint so it usually gets the same record every time), stores a pointer to the operation and marks
+   the record pending.
+2. If the combiner lock is free it takes it and becomes the combiner: it walks all the records and
+   runs every pending operation on the container, its own included, and marks each one done.
+3. Otherwise it spins on its own record until a combiner marks it done.
+
+So under contention one thread runs a whole batch of operations back to back with the container
+hot in its cache, and the others only touch their own record. An exception thrown by an operation
+is handed back to the thread that published it.
+
+apply(fn) runs fn(container) this way and returns what fn returns. The operation lives on the
+caller's stack, so nothing is allocated.
+*/
+template <typename Seq>
+class FlatCombining {
+    enum State {
+        kFree,
+        kClaimed,
+        kPending,
+        kDone
+    };
+
+    struct alignas(64) Record {
+        atomic<int> state;
+        void (*run)(void* op, Seq& seq);
+        void* op;
+        exception_ptr error;
+
+        Record() : state(kFree), run(nullptr), op(nullptr) {}
+    };
+
+    Seq seq_;
+    alignas(64) atomic<bool> combining_;
+    const size_t n_records_;
+    unique_ptr<Record[]> records_;
+
+    Record& claim() {
+        thread_local size_t hint = hash<thread::id> {} (this_thread::get_id());
+        while (true) {
+            for (size_t i = 0; i < n_records_; i++) {
+                Record& r = records_[(hint + i) % n_records_];
+                int expected = kFree;
+                if (r.state.load(memory_order_relaxed) == kFree &&
+                    r.state.compare_exchange_strong(expected, kClaimed, memory_order_acquire)) {
+                    return r;
+                }
+            }
+            this_thread::yield();
+        }
+    }
+
+    // Call holding combining_.
+    void combine() {
+        // A few passes, operations published while the first pass ran are picked up too.
+        for (int pass = 0; pass < 3; pass++) {
+            bool found = false;
+            for (size_t i = 0; i < n_records_; i++) {
+                Record& r = records_[i];
+                if (r.state.load(memory_order_acquire) != kPending) {
+                    continue;
+                }
+                found = true;
+                try {
+                    r.run(r.op, seq_);
+                } catch (...) {
+                    r.error = current_exception();
+                }
+                r.state.store(kDone, memory_order_release);
+            }
+            if (!found) {
+                break;
+            }
+        }
+    }
+
+    template <typename Op>
+    void publish(Op& op) {
+        Record& r = claim();
+        r.run = [](void* p, Seq& seq) { (*static_cast<Op*>(p))(seq); };
+        r.op = &op;
+        r.error = nullptr;
+        r.state.store(kPending, memory_order_release);
+
+        int spins = 0;
+        while (r.state.load(memory_order_acquire) != kDone) {
+            if (!combining_.load(memory_order_relaxed) && !combining_.exchange(true, memory_order_acquire)) {
+                combine();
+                combining_.store(false, memory_order_release);
+            } else if (++spins % 64 == 0) {
+                // Let the combiner run if it shares our core.
+                this_thread::yield();
+            }
+        }
+
+        exception_ptr error = r.error;
+        r.state.store(kFree, memory_order_release);
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+    public:
+
+    explicit FlatCombining(size_t records = 2 * thread::hardware_concurrency()) :
+    combining_(false),
+    n_records_(max<size_t>(records, 1)),
+    records_(new Record[n_records_]) {}
+
+    FlatCombining(const FlatCombining& other) = delete;
+    FlatCombining& operator=(const FlatCombining& other) = delete;
+
+    template <typename Fn>
+    auto apply(Fn fn) -> decltype(fn(seq_)) {
+        using R = decltype(fn(seq_));
+        if constexpr (is_void<R>::value) {
+            auto op = [&fn](Seq& seq) { fn(seq); };
+            publish(op);
+        } else {
+            optional<R> result;
+            auto op = [&fn, &result](Seq& seq) { result.emplace(fn(seq)); };
+            publish(op);
+            return std::move(*result);
+        }
+    }
+};
+
+// Same apply() on a plain mutex, to compare against.
+template <typename Seq>
+class Locked {
+    Seq seq_;
+    mutex mt_;
+
+    public:
+
+    template <typename Fn>
+    auto apply(Fn fn) -> decltype(fn(seq_)) {
+        lock_guard<mutex> lk(mt_);
+        return fn(seq_);
+    }
+};
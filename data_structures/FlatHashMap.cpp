@@ -0,0 +1,366 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <new>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "ThreadSafeMap.h"
+
+using namespace std;
+
+/*
+Open addressing hash map with 16 wide probe groups (the SwissTable layout).
+
+Bucket::getKey walks a std::list, one cache miss per node. Here the entries sit in flat arrays:
+
+1. Slots come in groups of 16. Each slot has one control byte: empty, deleted, or for a full slot
+   the low 7 bits of its key's hash (the tag). The 16 control bytes of a group are one SSE2 load,
+   one compare against the tag gives a bitmask of the slots worth comparing keys for. So a lookup
+   reads one line of control bytes and, almost always, exactly one slot.
+2. The remaining hash bits pick the home group. Probing moves on to the next group (triangular
+   steps) only if the group is full. A group with an empty slot ends the probe, deletes leave a
+   tombstone in groups that have no empty slot so they do not cut a probe sequence short.
+3. Locking: the probe sequence of a key can cross many groups, so a lock per group would have to
+   be taken in probe order, and two keys probe in different orders. Instead the map is split into
+   shards by the top bits of the hash, each shard is a table of its own with its own shared_mutex,
+   and a key only ever probes within its shard. Shards also grow on their own, at 7/8 load, so a
+   resize only blocks one shard.
+
+Same put / get / deleteKey interface as ThreadSafeMap.
+*/
+template <typename KEY, typename VALUE, typename HASH = FastHash<KEY> >
+class FlatHashMap {
+    static constexpr uint8_t kEmpty = 0x80;
+    static constexpr uint8_t kDeleted = 0xFE;
+    static constexpr size_t kGroupSize = 16;
+
+    using Entry = pair<KEY, VALUE>;
+
+    struct alignas(16) Group {
+        uint8_t ctrl[kGroupSize];
+    };
+
+    struct Slot {
+        typename aligned_storage<sizeof(Entry), alignof(Entry)>::type storage;
+
+        Entry* entry() {
+            return reinterpret_cast<Entry*>(&storage);
+        }
+    };
+
+    // Bit i is set if ctrl[i] == tag.
+    static uint32_t match(const Group& g, uint8_t tag) {
+#if defined(__SSE2__)
+        __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i*>(g.ctrl));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(tag))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupSize; i++) {
+            mask |= uint32_t(g.ctrl[i] == tag) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Bit i is set if slot i is empty or deleted, which are the control bytes with the top bit set.
+    static uint32_t matchFree(const Group& g) {
+#if defined(__SSE2__)
+        return _mm_movemask_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(g.ctrl)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupSize; i++) {
+            mask |= uint32_t(g.ctrl[i] >> 7) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static int lowestBit(uint32_t mask) {
+        return __builtin_ctz(mask);
+    }
+
+    struct alignas(64) Shard {
+        shared_mutex mt;
+        unique_ptr<Group[]> groups;
+        unique_ptr<Slot[]> slots;
+        size_t group_mask;
+        size_t size;
+        size_t deleted;
+
+        Shard() : groups(new Group[1]), slots(new Slot[kGroupSize]), group_mask(0), size(0), deleted(0) {
+            memset(groups.get(), kEmpty, sizeof(Group));
+        }
+
+        ~Shard() {
+            destroyAll();
+        }
+
+        void destroyAll() {
+            for (size_t g = 0; g <= group_mask; g++) {
+                for (size_t i = 0; i < kGroupSize; i++) {
+                    if (!(groups[g].ctrl[i] & 0x80)) {
+                        slots[g * kGroupSize + i].entry()->~Entry();
+                    }
+                }
+            }
+        }
+
+        size_t capacity() {
+            return (group_mask + 1) * kGroupSize;
+        }
+
+        // Call holding mt. Returns the slot index of key, or -1.
+        long find(const KEY& key, size_t h) {
+            size_t g = (h >> 7) & group_mask;
+            uint8_t tag = h & 0x7F;
+            for (size_t step = 1; ; step++) {
+                Group& group = groups[g];
+                for (uint32_t m = match(group, tag); m; m &= m - 1) {
+                    size_t idx = g * kGroupSize + lowestBit(m);
+                    if (slots[idx].entry()->first == key) {
+                        return idx;
+                    }
+                }
+                if (match(group, kEmpty)) {
+                    return -1;
+                }
+                g = (g + step) & group_mask;
+            }
+        }
+
+        // Call holding mt exclusively, with key not in the shard and room for it.
+        Entry* insertNew(size_t h, KEY&& key, VALUE&& value) {
+            size_t g = (h >> 7) & group_mask;
+            for (size_t step = 1; ; step++) {
+                uint32_t m = matchFree(groups[g]);
+                if (m) {
+                    int i = lowestBit(m);
+                    size_t idx = g * kGroupSize + i;
+                    Entry* e = new (slots[idx].entry()) Entry(std::move(key), std::move(value));
+                    if (groups[g].ctrl[i] == kDeleted) {
+                        deleted--;
+                    }
+                    groups[g].ctrl[i] = h & 0x7F;
+                    size++;
+                    return e;
+                }
+                g = (g + step) & group_mask;
+            }
+        }
+
+        void erase(size_t idx) {
+            size_t g = idx / kGroupSize;
+            slots[idx].entry()->~Entry();
+            // A group that still has an empty slot ends every probe anyway, no tombstone needed.
+            if (match(groups[g], kEmpty)) {
+                groups[g].ctrl[idx % kGroupSize] = kEmpty;
+            } else {
+                groups[g].ctrl[idx % kGroupSize] = kDeleted;
+                deleted++;
+            }
+            size--;
+        }
+
+        // Grows (or, if mostly tombstones, just rebuilds) so that one more entry fits under 7/8 load.
+        template <typename Hasher>
+        void reserveOne(Hasher& hasher) {
+            if ((size + deleted + 1) * 8 <= capacity() * 7) {
+                return;
+            }
+            size_t n_groups = group_mask + 1;
+            if ((size + 1) * 16 > capacity() * 7) {
+                n_groups *= 2;
+            }
+
+            // Allocate before touching anything, a bad_alloc leaves the shard as it was.
+            unique_ptr<Group[]> old_groups(new Group[n_groups]);
+            unique_ptr<Slot[]> old_slots(new Slot[n_groups * kGroupSize]);
+            memset(old_groups.get(), kEmpty, n_groups * sizeof(Group));
+            swap(groups, old_groups);
+            swap(slots, old_slots);
+            size_t old_n_groups = group_mask + 1;
+            group_mask = n_groups - 1;
+            size = 0;
+            deleted = 0;
+            for (size_t g = 0; g < old_n_groups; g++) {
+                for (size_t i = 0; i < kGroupSize; i++) {
+                    if (old_groups[g].ctrl[i] & 0x80) {
+                        continue;
+                    }
+                    Entry* e = old_slots[g * kGroupSize + i].entry();
+                    KEY key = std::move(e->first);
+                    insertNew(hasher(key), std::move(key), std::move(e->second));
+                    e->~Entry();
+                }
+            }
+        }
+    };
+
+    size_t shard_mask_;
+    unique_ptr<Shard[]> shards_;
+    HASH hasher_;
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 1;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    Shard& shardFor(size_t h) {
+        // Top bits pick the shard, the low bits are the tag and the home group.
+        return shards_[(h >> 40) & shard_mask_];
+    }
+
+    public:
+
+    explicit FlatHashMap(size_t n_shards = default_num_stripes, HASH hasher = HASH()) :
+    shard_mask_(roundUp(max<size_t>(min<size_t>(n_shards, 1 << 20), 1)) - 1),
+    shards_(new Shard[shard_mask_ + 1]),
+    hasher_(hasher) {}
+
+    FlatHashMap(const FlatHashMap& other) = delete;
+    FlatHashMap& operator=(const FlatHashMap& other) = delete;
+
+    void put(KEY key, VALUE value) {
+        size_t h = hasher_(key);
+        Shard& shard = shardFor(h);
+        lock_guard<shared_mutex> lk(shard.mt);
+        long idx = shard.find(key, h);
+        if (idx >= 0) {
+            shard.slots[idx].entry()->second = std::move(value);
+            return;
+        }
+        shard.reserveOne(hasher_);
+        shard.insertNew(h, std::move(key), std::move(value));
+    }
+
+    shared_ptr<VALUE> get(KEY key) {
+        size_t h = hasher_(key);
+        Shard& shard = shardFor(h);
+        shared_lock<shared_mutex> lk(shard.mt);
+        long idx = shard.find(key, h);
+        return idx < 0 ? shared_ptr<VALUE>() : make_shared<VALUE>(shard.slots[idx].entry()->second);
+    }
+
+    bool deleteKey(KEY key) {
+        size_t h = hasher_(key);
+        Shard& shard = shardFor(h);
+        lock_guard<shared_mutex> lk(shard.mt);
+        long idx = shard.find(key, h);
+        if (idx < 0) {
+            return false;
+        }
+        shard.erase(idx);
+        return true;
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (size_t i = 0; i <= shard_mask_; i++) {
+            shared_lock<shared_mutex> lk(shards_[i].mt);
+            n += shards_[i].size;
+        }
+        return n;
+    }
+};
+
+void testFlatHashMap() {
+    FlatHashMap<string, int> mp(4);
+    assert(!mp.get("a"));
+    bool deleted = mp.deleteKey("a");
+    assert(!deleted);
+    mp.put("a", 1);
+    mp.put("a", 2);
+    assert(*mp.get("a") == 2);
+    deleted = mp.deleteKey("a");
+    assert(deleted);
+    assert(!mp.get("a"));
+
+    // Grow well past the first group, delete half, and keep inserting over the tombstones.
+    FlatHashMap<long, long> big(2);
+    for (long i = 0; i < 100000; i++) {
+        big.put(i, i * 3);
+    }
+    for (long i = 0; i < 100000; i += 2) {
+        deleted = big.deleteKey(i);
+        assert(deleted);
+    }
+    for (long i = 100000; i < 150000; i++) {
+        big.put(i, i * 3);
+    }
+    for (long i = 0; i < 150000; i++) {
+        shared_ptr<long> val = big.get(i);
+        assert(i < 100000 && i % 2 == 0 ? !val : *val == i * 3);
+    }
+    assert(big.size() == 100000);
+    cout << "FlatHashMap test passed" << endl;
+}
+
+void testConcurrent() {
+    FlatHashMap<long, long> mp(16);
+    const int threads = 8;
+    const long per_thread = 20000;
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&mp, t, per_thread]() {
+            for (long i = 0; i < per_thread; i++) {
+                long key = t * per_thread + i;
+                mp.put(key, key);
+                assert(*mp.get(key) == key);
+                if (i % 2) {
+                    bool deleted = mp.deleteKey(key);
+                    assert(deleted);
+                }
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    assert(mp.size() == threads * per_thread / 2);
+    cout << "Concurrent test passed" << endl;
+}
+
+// Lookups of present and absent keys in a table much bigger than the caches.
+template <typename Map>
+void bench(const string& name, Map& mp) {
+    const long n = 1 << 20;
+    for (long i = 0; i < n; i++) {
+        mp.put(i, i);
+    }
+
+    minstd_rand rng(1);
+    const long lookups = 4000000;
+    long found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < lookups; i++) {
+        found += mp.get(rng() % (2 * n)) != nullptr;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    assert(found > lookups / 3);
+    cout << name << ": " << (lookups / secs / 1e6) << " M gets/s" << endl;
+}
+
+int main() {
+    testFlatHashMap();
+    testConcurrent();
+
+    ThreadSafeMap<long, long> chained(1 << 20);
+    bench("ThreadSafeMap", chained);
+    FlatHashMap<long, long> flat;
+    bench("FlatHashMap", flat);
+}
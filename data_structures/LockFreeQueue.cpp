@@ -0,0 +1,396 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+#include <cassert>
+
+using namespace std;
+
+/*
+Hazard pointers (C++ Concurrency in Action, chapter 7).
+
+A thread that is about to dereference a node publishes its address in a hazard pointer slot. A
+node that has been unlinked is not deleted straight away, it goes on a reclaim list and is only
+deleted once no slot holds its address.
+
+Differences from the book version:
+1. Each thread owns two slots, the queue needs to protect both head and head->next while popping.
+2. The reclaim list is only scanned once it holds more nodes than there are slots, so the cost of
+   walking all slots is amortised over many pops instead of being paid on every pop.
+*/
+const unsigned max_hazard_pointers = 512;
+
+struct HazardPointer {
+    atomic<thread::id> id;
+    atomic<void*> pointer;
+};
+
+HazardPointer hazard_pointers[max_hazard_pointers];
+
+class HpOwner {
+    HazardPointer* hp_;
+
+    public:
+
+    HpOwner() : hp_(nullptr) {
+        for (unsigned i = 0; i < max_hazard_pointers; i++) {
+            thread::id old_id;
+            if (hazard_pointers[i].id.compare_exchange_strong(old_id, this_thread::get_id())) {
+                hp_ = &hazard_pointers[i];
+                break;
+            }
+        }
+
+        if (!hp_) {
+            throw std::runtime_error("No hazard pointers available");
+        }
+    }
+
+    HpOwner(const HpOwner& other) = delete;
+    HpOwner& operator=(const HpOwner& other) = delete;
+
+    atomic<void*>& get_pointer() {
+        return hp_->pointer;
+    }
+
+    ~HpOwner() {
+        hp_->pointer.store(nullptr);
+        hp_->id.store(thread::id());
+    }
+};
+
+atomic<void*>& get_hazard_pointer_for_current_thread(int slot) {
+    thread_local static HpOwner hazards[2];
+    return hazards[slot].get_pointer();
+}
+
+bool outstanding_hazard_pointers_for(void* p) {
+    for (unsigned i = 0; i < max_hazard_pointers; i++) {
+        if (hazard_pointers[i].pointer.load() == p) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename T>
+void do_delete(void* p) {
+    delete static_cast<T*>(p);
+}
+
+struct DataToReclaim {
+    void* data;
+    function<void(void*)> deleter;
+    DataToReclaim* next;
+
+    template <typename T>
+    DataToReclaim(T* p) : data(p), deleter(&do_delete<T>), next(nullptr) {}
+
+    ~DataToReclaim() {
+        deleter(data);
+    }
+};
+
+atomic<DataToReclaim*> nodes_to_reclaim;
+atomic<unsigned> nodes_to_reclaim_count;
+
+void add_to_reclaim_list(DataToReclaim* node) {
+    node->next = nodes_to_reclaim.load();
+    while (!nodes_to_reclaim.compare_exchange_weak(node->next, node));
+}
+
+void delete_nodes_with_no_hazards() {
+    DataToReclaim* current = nodes_to_reclaim.exchange(nullptr);
+    while (current) {
+        DataToReclaim* const next = current->next;
+        if (!outstanding_hazard_pointers_for(current->data)) {
+            delete current;
+            nodes_to_reclaim_count--;
+        } else {
+            add_to_reclaim_list(current);
+        }
+        current = next;
+    }
+}
+
+template <typename T>
+void reclaim_later(T* data) {
+    add_to_reclaim_list(new DataToReclaim(data));
+    if (++nodes_to_reclaim_count > 2 * max_hazard_pointers) {
+        delete_nodes_with_no_hazards();
+    }
+}
+
+// Publish the current value of src in hp and make sure it did not change while doing so.
+template <typename Node>
+Node* protect(atomic<void*>& hp, atomic<Node*>& src) {
+    Node* p = src.load();
+    Node* temp;
+    do {
+        temp = p;
+        hp.store(p);
+        p = src.load();
+    } while (p != temp);
+    return p;
+}
+
+/*
+Michael-Scott lock-free MPMC queue.
+
+Same dummy node layout as ThreadSafeQueue in FineGrainedThreadSafeQueue.cpp: head_ always points at
+a dummy whose successor holds the front element. Push links a new node after tail_ with a CAS and
+then swings tail_, any thread that sees tail_ lagging helps swing it. TryPop swings head_ to its
+successor, which then becomes the new dummy, and hands the old dummy to the hazard pointer reclaimer.
+
+The value is moved out of the node only by the thread whose CAS on head_ succeeded, so no two
+threads ever touch the same shared_ptr. Hazard pointer 1 keeps that node alive while we do it.
+
+WaitAndPop parks on a condition variable, Push only takes the wait mutex when a consumer has
+announced itself in waiters_.
+*/
+template <typename T>
+class LockFreeQueue {
+    private:
+    struct Node {
+        shared_ptr<T> data;
+        atomic<Node*> next;
+
+        Node() : next(nullptr) {}
+    };
+
+    atomic<Node*> head_;
+    atomic<Node*> tail_;
+
+    atomic<int> waiters_;
+    mutex wait_mt_;
+    condition_variable cnd_;
+
+    public:
+
+    LockFreeQueue() : waiters_(0) {
+        Node* dummy = new Node();
+        head_.store(dummy);
+        tail_.store(dummy);
+    }
+
+    LockFreeQueue(const LockFreeQueue& other) = delete;
+    LockFreeQueue& operator=(const LockFreeQueue& other) = delete;
+
+    ~LockFreeQueue() {
+        Node* cur = head_.load();
+        while (cur) {
+            Node* next = cur->next.load();
+            delete cur;
+            cur = next;
+        }
+        delete_nodes_with_no_hazards();
+    }
+
+    void Push(T new_val) {
+        Node* new_node = new Node();
+        new_node->data = make_shared<T>(std::move(new_val));
+
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread(0);
+        while (true) {
+            Node* tail = protect(hp, tail_);
+            Node* next = tail->next.load();
+            if (tail != tail_.load()) {
+                continue;
+            }
+
+            if (next != nullptr) {
+                // Another push linked its node but has not swung tail_ yet, help it.
+                tail_.compare_exchange_weak(tail, next);
+                continue;
+            }
+
+            if (tail->next.compare_exchange_weak(next, new_node)) {
+                tail_.compare_exchange_strong(tail, new_node);
+                break;
+            }
+        }
+        hp.store(nullptr);
+
+        if (waiters_.load() > 0) {
+            lock_guard<mutex> lk(wait_mt_);
+            cnd_.notify_one();
+        }
+    }
+
+    shared_ptr<T> TryPop() {
+        atomic<void*>& hp_head = get_hazard_pointer_for_current_thread(0);
+        atomic<void*>& hp_next = get_hazard_pointer_for_current_thread(1);
+        shared_ptr<T> result;
+
+        while (true) {
+            Node* head = protect(hp_head, head_);
+            Node* tail = tail_.load();
+            Node* next = head->next.load();
+            hp_next.store(next);
+            // While head is still head_, next is its successor and cannot have been reclaimed.
+            if (head != head_.load()) {
+                continue;
+            }
+
+            if (next == nullptr) {
+                // Only the dummy node present.
+                break;
+            }
+
+            if (head == tail) {
+                tail_.compare_exchange_weak(tail, next);
+                continue;
+            }
+
+            if (head_.compare_exchange_strong(head, next)) {
+                result = std::move(next->data);
+                hp_head.store(nullptr);
+                reclaim_later(head);
+                break;
+            }
+        }
+
+        hp_head.store(nullptr);
+        hp_next.store(nullptr);
+        return result;
+    }
+
+    shared_ptr<T> WaitAndPop() {
+        shared_ptr<T> result = TryPop();
+        if (result) {
+            return result;
+        }
+
+        unique_lock<mutex> lk(wait_mt_);
+        waiters_++;
+        cnd_.wait(lk, [&]() { return (result = TryPop()) != nullptr; });
+        waiters_--;
+        return result;
+    }
+
+    bool empty() {
+        atomic<void*>& hp = get_hazard_pointer_for_current_thread(0);
+        Node* head = protect(hp, head_);
+        bool res = head->next.load() == nullptr;
+        hp.store(nullptr);
+        return res;
+    }
+};
+
+template <typename T>
+void runThread(shared_ptr<LockFreeQueue<T> > q, int adds, int removs) {
+    for (int i = 0; i < adds; i++) {
+        q->Push(rand() % 10);
+    }
+
+    while (removs--) {
+        auto val = q->WaitAndPop();
+        assert(val != nullptr);
+    }
+}
+
+void testLockFreeQueue() {
+    auto q = make_shared<LockFreeQueue<int> > ();
+    int add1 = rand() % 10 + 2;
+    int removs1 = rand() % add1;
+
+    int add2 = rand() % 10 + 2;
+    int removs2 = rand() % 10 % add2;
+
+    thread t1(runThread<int>, q, add1, removs1);
+    thread t2(runThread<int>, q, add2, removs2);
+
+    t1.join();
+    t2.join();
+
+    int left = 0;
+    while (q->TryPop()) {
+        left++;
+    }
+    assert(left == (add1 + add2 - removs1 - removs2));
+    assert(q->empty());
+    cout << "Test passed " << endl;
+}
+
+// Every pushed value must come out exactly once, and values from one producer must stay in order.
+void testNoLossNoDuplicates() {
+    LockFreeQueue<long> q;
+    const int producers = 4;
+    const int consumers = 4;
+    const long per_producer = 20000;
+
+    vector<thread> threads;
+    vector<vector<long> > seen(consumers);
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&q, p, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                q.Push(p * per_producer + i);
+            }
+        }));
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.push_back(thread([&q, &seen, c, producers, consumers, per_producer]() {
+            long count = producers * per_producer / consumers;
+            vector<long> last(producers, -1);
+            while (count--) {
+                long v = *q.WaitAndPop();
+                assert(v > last[v / per_producer]);
+                last[v / per_producer] = v;
+                seen[c].push_back(v);
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    vector<bool> got(producers * per_producer, false);
+    for (auto& s : seen) {
+        for (long v : s) {
+            assert(!got[v]);
+            got[v] = true;
+        }
+    }
+    cout << "No loss / no duplicates test passed" << endl;
+}
+
+void benchThroughput(int pairs) {
+    LockFreeQueue<int> q;
+    const long total = 1000000;
+    long per_thread = total / pairs;
+
+    vector<thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < pairs; i++) {
+        threads.push_back(thread([&q, per_thread]() {
+            for (long j = 0; j < per_thread; j++) {
+                q.Push(j);
+            }
+        }));
+        threads.push_back(thread([&q, per_thread]() {
+            for (long j = 0; j < per_thread; j++) {
+                q.WaitAndPop();
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << pairs << " producers / " << pairs << " consumers: "
+         << (2 * per_thread * pairs / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testLockFreeQueue();
+    testNoLossNoDuplicates();
+    for (int pairs : {1, 2, 4, 8, 16, 32, 64}) {
+        benchThroughput(pairs);
+    }
+}
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cassert>
+
+#include "LockFreeStack.h"
+#include "ThreadSafeStack.h"
+
+using namespace std;
+
+void testSequential() {
+    LockFreeStack<string> st;
+    assert(st.empty());
+    shared_ptr<string> none = st.Pop();
+    assert(!none);
+    st.Push("a");
+    st.Push("b");
+    st.Push("c");
+
+    optional<string> top = st.TryPopValue();
+    assert(*top == "c");
+    string next = st.WaitAndPopValue();
+    assert(next == "b");
+    string val;
+    st.Pop(val);
+    assert(val == "a");
+    assert(st.empty());
+
+    bool threw = false;
+    try {
+        st.Pop(val);
+    } catch (const std::exception&) {
+        threw = true;
+    }
+    assert(threw);
+    cout << "Sequential test passed" << endl;
+}
+
+// Threads push and pop the same small set of nodes over and over, which is where ABA would lose or
+// duplicate elements.
+void testConcurrent() {
+    LockFreeStack<long> st;
+    const int threads = 8;
+    const long per_thread = 100000;
+    atomic<long> pushed_sum(0);
+    atomic<long> popped_sum(0);
+
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&, t]() {
+            long pushed = 0;
+            long popped = 0;
+            for (long i = 0; i < per_thread; i++) {
+                long v = t * per_thread + i;
+                st.Push(v);
+                pushed += v;
+                if (i % 2 == 0) {
+                    long out;
+                    st.WaitAndPop(out);
+                    popped += out;
+                } else if (auto out = st.TryPopValue()) {
+                    popped += *out;
+                }
+            }
+            pushed_sum += pushed;
+            popped_sum += popped;
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    while (auto out = st.TryPopValue()) {
+        popped_sum += *out;
+    }
+    assert(pushed_sum == popped_sum);
+    cout << "Concurrent test passed" << endl;
+}
+
+template <typename Stack>
+void bench(const string& name, int threads) {
+    Stack st;
+    const long ops = 1000000;
+    long per_thread = ops / threads;
+
+    vector<thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&st, per_thread]() {
+            for (long i = 0; i < per_thread; i++) {
+                st.Push(i);
+                st.TryPopValue();
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << name << ", " << threads << " threads: " << (2 * per_thread * threads / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testSequential();
+    testConcurrent();
+    for (int threads : {1, 2, 4, 8, 16, 32, 64}) {
+        bench<ThreadSafeStack<long> >("mutex", threads);
+        bench<LockFreeStack<long> >("lock free", threads);
+    }
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <cstdint>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+Treiber stack (C++ Concurrency in Action, 7.2) with tagged pointers against ABA.
+
+The top of the stack is one atomic word, Push and Pop are a CAS on it, so a thread that is
+preempted never blocks the others the way the mutex in ThreadSafeStack does.
+
+Two classic problems with the naive version:
+1. ABA. Thread A reads top == X and X->next == Y and gets preempted. B pops X and Y and pushes X
+   back. A's CAS(X -> Y) succeeds and Y, no longer in the stack, becomes the top. So the top word
+   also carries a 16 bit tag that every successful CAS increments: A's CAS sees a different tag
+   and fails. x86-64 and AArch64 user space pointers fit in the low 48 bits, the tag takes the rest,
+   and a plain 64 bit CAS is enough. A thread would have to sleep across exactly a multiple of 65536
+   pops for the tag to come back around.
+2. Reading X->next after another thread popped and freed X. Nodes are never freed while the stack
+   lives: a popped node goes to a free list (also a tagged Treiber stack) and the next Push reuses
+   it. A stale read of next is then harmless, the tag makes the CAS fail, and steady state Push/Pop
+   does not allocate. The price is that the stack keeps the memory of its peak size.
+
+Interface as ThreadSafeStack. WaitAndPop parks on an EventCount.
+*/
+template <typename T>
+struct StackNode {
+    optional<T> value;
+    atomic<StackNode*> next;
+
+    StackNode() : next(nullptr) {}
+};
+
+// Treiber list of nodes with the tag in the top 16 bits of the head word.
+template <typename T>
+class TaggedList {
+    static_assert(sizeof(void*) == 8, "Tagged pointers need 64 bit pointers");
+
+    using Node = StackNode<T>;
+
+    static constexpr int kTagShift = 48;
+    static constexpr uint64_t kPtrMask = (uint64_t(1) << kTagShift) - 1;
+
+    atomic<uint64_t> head_;
+
+    static Node* ptr(uint64_t word) {
+        return reinterpret_cast<Node*>(word & kPtrMask);
+    }
+
+    static uint64_t next_word(uint64_t old, Node* p) {
+        return ((old >> kTagShift) + 1) << kTagShift | reinterpret_cast<uint64_t>(p);
+    }
+
+    public:
+
+    enum Result {
+        kDone,
+        kEmpty,
+        kContended
+    };
+
+    TaggedList() : head_(0) {}
+
+    void push(Node* node) {
+        uint64_t old = head_.load(memory_order_relaxed);
+        do {
+            node->next.store(ptr(old), memory_order_relaxed);
+        } while (!head_.compare_exchange_weak(old, next_word(old, node), memory_order_release,
+                                              memory_order_relaxed));
+    }
+
+    Node* pop() {
+        uint64_t old = head_.load(memory_order_acquire);
+        while (Node* node = ptr(old)) {
+            Node* next = node->next.load(memory_order_relaxed);
+            if (head_.compare_exchange_weak(old, next_word(old, next), memory_order_acquire,
+                                            memory_order_acquire)) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    // Single CAS attempts, for callers that do something else when the top is contended.
+    bool tryPush(Node* node) {
+        uint64_t old = head_.load(memory_order_relaxed);
+        node->next.store(ptr(old), memory_order_relaxed);
+        return head_.compare_exchange_strong(old, next_word(old, node), memory_order_release,
+                                             memory_order_relaxed);
+    }
+
+    Result tryPop(Node*& out) {
+        uint64_t old = head_.load(memory_order_acquire);
+        Node* node = ptr(old);
+        if (!node) {
+            return kEmpty;
+        }
+        Node* next = node->next.load(memory_order_relaxed);
+        if (!head_.compare_exchange_strong(old, next_word(old, next), memory_order_acquire,
+                                           memory_order_relaxed)) {
+            return kContended;
+        }
+        out = node;
+        return kDone;
+    }
+
+    bool empty() {
+        return ptr(head_.load(memory_order_acquire)) == nullptr;
+    }
+
+    // Not thread safe, for the destructor.
+    void deleteAll() {
+        while (Node* node = pop()) {
+            delete node;
+        }
+    }
+};
+
+template <typename T>
+class LockFreeStack {
+    using Node = StackNode<T>;
+
+    TaggedList<T> stack_;
+    TaggedList<T> free_;
+    EventCount st_not_empty_;
+
+    template <typename U>
+    using IfNothrowMove = typename enable_if<is_nothrow_move_constructible<U>::value, int>::type;
+
+    // Pops a node and hands its value to take. If take throws the node goes back on the stack.
+    template <typename Take>
+    bool popWith(Take take) {
+        Node* node = stack_.pop();
+        if (!node) {
+            return false;
+        }
+        try {
+            take(*node->value);
+        } catch (...) {
+            stack_.push(node);
+            throw;
+        }
+        node->value.reset();
+        free_.push(node);
+        return true;
+    }
+
+    public:
+
+    LockFreeStack() {}
+    LockFreeStack(const LockFreeStack& other) = delete;
+    LockFreeStack& operator=(const LockFreeStack&) = delete;
+
+    ~LockFreeStack() {
+        stack_.deleteAll();
+        free_.deleteAll();
+    }
+
+    void Push(T value) {
+        Node* node = free_.pop();
+        if (!node) {
+            node = new Node();
+        }
+        try {
+            node->value.emplace(std::move(value));
+        } catch (...) {
+            free_.push(node);
+            throw;
+        }
+        stack_.push(node);
+        st_not_empty_.NotifyOne();
+    }
+
+    shared_ptr<T> Pop() {
+        shared_ptr<T> val;
+        popWith([&](T& top) { val = make_shared<T>(std::move_if_noexcept(top)); });
+        return val;
+    }
+
+    void Pop(T& value) {
+        if (!popWith([&](T& top) { value = std::move_if_noexcept(top); })) {
+            throw std::exception();
+        }
+    }
+
+    void WaitAndPop(T& value) {
+        Await(st_not_empty_, [&]() { return popWith([&](T& top) { value = std::move_if_noexcept(top); }); });
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    optional<T> TryPopValue() {
+        optional<T> val;
+        popWith([&](T& top) { val.emplace(std::move(top)); });
+        return val;
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    T WaitAndPopValue() {
+        optional<T> val;
+        Await(st_not_empty_, [&]() { return popWith([&](T& top) { val.emplace(std::move(top)); }); });
+        return std::move(*val);
+    }
+
+    bool empty() {
+        return stack_.empty();
+    }
+};
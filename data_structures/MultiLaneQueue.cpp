@@ -0,0 +1,223 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <queue>
+#include <random>
+#include <functional>
+#include <chrono>
+#include <cassert>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+Relaxed FIFO queue made of independent lanes.
+
+With one lock (or one head/tail pair) every producer fights over the same cache line. Here:
+
+1. Each producer pushes into the lane picked by hashing its thread id, so producers on different
+   lanes never touch each other's lock. Elements from one producer all land in the same lane, in
+   order, so per-producer FIFO is kept. There is no order between producers.
+2. A consumer sweeps the lanes starting at a random offset, so consumers spread over the lanes
+   instead of all starting at lane 0. The first sweep only try_locks, a lane somebody else is working
+   on is skipped. Each lane keeps an atomic size so empty lanes are skipped without locking.
+3. WaitAndPop parks on an EventCount shared by all lanes, Push only pays for a wake when somebody
+   is parked.
+
+Same Push / TryPop / WaitAndPop interface as ThreadSafeQueue.
+*/
+template <typename T>
+class MultiLaneQueue {
+    struct alignas(64) Lane {
+        mutex mt;
+        queue<shared_ptr<T> > q;
+        atomic<size_t> sz;
+
+        Lane() : sz(0) {}
+    };
+
+    size_t mask_;
+    unique_ptr<Lane[]> lanes_;
+    EventCount not_empty_;
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 1;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    Lane& myLane() {
+        thread_local size_t id = hash<thread::id> {} (this_thread::get_id());
+        return lanes_[id & mask_];
+    }
+
+    size_t randomStart() {
+        thread_local minstd_rand rng(hash<thread::id> {} (this_thread::get_id()));
+        return rng() & mask_;
+    }
+
+    // Call holding lane.mt.
+    shared_ptr<T> popFrom(Lane& lane) {
+        if (lane.q.empty()) {
+            return shared_ptr<T>();
+        }
+        shared_ptr<T> val = std::move(lane.q.front());
+        lane.q.pop();
+        lane.sz.fetch_sub(1, memory_order_relaxed);
+        return val;
+    }
+
+    shared_ptr<T> sweep() {
+        size_t start = randomStart();
+
+        // First pass: skip lanes that are empty or busy.
+        for (size_t i = 0; i <= mask_; i++) {
+            Lane& lane = lanes_[(start + i) & mask_];
+            if (lane.sz.load(memory_order_relaxed) == 0) {
+                continue;
+            }
+            unique_lock<mutex> lk(lane.mt, try_to_lock);
+            if (!lk.owns_lock()) {
+                continue;
+            }
+            if (shared_ptr<T> val = popFrom(lane)) {
+                return val;
+            }
+        }
+
+        // Second pass: wait for the lock of every non empty lane.
+        for (size_t i = 0; i <= mask_; i++) {
+            Lane& lane = lanes_[(start + i) & mask_];
+            if (lane.sz.load(memory_order_acquire) == 0) {
+                continue;
+            }
+            lock_guard<mutex> lk(lane.mt);
+            if (shared_ptr<T> val = popFrom(lane)) {
+                return val;
+            }
+        }
+
+        return shared_ptr<T>();
+    }
+
+    public:
+
+    MultiLaneQueue(size_t lanes = thread::hardware_concurrency()) :
+    mask_(roundUp(max<size_t>(lanes, 1)) - 1),
+    lanes_(new Lane[mask_ + 1]) {}
+
+    MultiLaneQueue(const MultiLaneQueue& other) = delete;
+    MultiLaneQueue& operator=(const MultiLaneQueue& other) = delete;
+
+    void Push(T new_val) {
+        shared_ptr<T> data_ptr = make_shared<T>(std::move(new_val));
+        Lane& lane = myLane();
+        {
+            lock_guard<mutex> lk(lane.mt);
+            lane.q.push(std::move(data_ptr));
+            lane.sz.fetch_add(1, memory_order_release);
+        }
+        not_empty_.NotifyOne();
+    }
+
+    shared_ptr<T> TryPop() {
+        return sweep();
+    }
+
+    shared_ptr<T> WaitAndPop() {
+        while (true) {
+            if (shared_ptr<T> val = sweep()) {
+                return val;
+            }
+
+            uint32_t key = not_empty_.PrepareWait();
+            if (shared_ptr<T> val = sweep()) {
+                not_empty_.CancelWait();
+                return val;
+            }
+            not_empty_.Wait(key);
+        }
+    }
+
+    size_t lanes() {
+        return mask_ + 1;
+    }
+};
+
+// Every element comes out exactly once and each producer's elements come out in order.
+void testPerProducerFifo() {
+    MultiLaneQueue<long> q(4);
+    const int producers = 6;
+    const long per_producer = 20000;
+
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&q, p, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                q.Push(p * per_producer + i);
+            }
+        }));
+    }
+
+    vector<long> last(producers, -1);
+    long total = 0;
+    while (total < producers * per_producer) {
+        long v = *q.WaitAndPop();
+        assert(v > last[v / per_producer]);
+        last[v / per_producer] = v;
+        total++;
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    for (int p = 0; p < producers; p++) {
+        assert(last[p] == (p + 1) * per_producer - 1);
+    }
+    auto rest = q.TryPop();
+    assert(!rest);
+    cout << "Per producer FIFO test passed" << endl;
+}
+
+void bench(size_t lanes, int producers, int consumers) {
+    MultiLaneQueue<int> q(lanes);
+    const long total = 2000000;
+    long per_producer = total / producers;
+    long per_consumer = per_producer * producers / consumers;
+
+    vector<thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&q, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                q.Push(i);
+            }
+        }));
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.push_back(thread([&q, per_consumer]() {
+            for (long i = 0; i < per_consumer; i++) {
+                q.WaitAndPop();
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << q.lanes() << " lanes, " << producers << " producers / " << consumers << " consumers: "
+         << (2 * per_consumer * consumers / secs / 1e6) << " M ops/s" << endl;
+}
+
+int main() {
+    testPerProducerFifo();
+    for (size_t lanes : {1, 4, 16, 64}) {
+        bench(lanes, 48, 4);
+    }
+}
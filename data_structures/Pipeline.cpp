@@ -0,0 +1,92 @@
+#include <iostream>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cassert>
+
+#include "Pipeline.h"
+
+using namespace std;
+
+// parse -> square (4 workers, ordered) -> format -> collect, the sink has to see the source order.
+void testOrdered() {
+    Pipeline p;
+    long next = 0;
+    const long n = 100000;
+
+    auto numbers = p.source<long>("read", {1, false, 1, 64}, [&next, n](long& out) {
+        if (next == n) {
+            return false;
+        }
+        out = next++;
+        return true;
+    });
+    auto squares = p.stage("square", numbers, {4, true, 32, 64}, [](long x) { return x * x; });
+    auto lines = p.stage("format", squares, {1, false, 32, 64}, [](long x) { return to_string(x); });
+
+    vector<string> seen;
+    p.sink("collect", lines, {1, false, 32, 64}, [&seen](string line) { seen.push_back(line); });
+    p.run();
+
+    assert((long)seen.size() == n);
+    for (long i = 0; i < n; i++) {
+        assert(seen[i] == to_string(i * i));
+    }
+
+    vector<StageMetrics> m = p.metrics();
+    assert(m.size() == 4);
+    for (auto& stage : m) {
+        assert(stage.items == n);
+        assert(stage.max_depth <= 64);
+    }
+    cout << "Ordered pipeline test passed" << endl;
+}
+
+// Unordered stages with several workers still deliver every item exactly once.
+void testUnordered() {
+    Pipeline p;
+    atomic<long> next(0);
+    const long n = 100000;
+
+    auto numbers = p.source<long>("read", {}, [&next, n](long& out) {
+        out = next++;
+        return out < n;
+    });
+    auto doubled = p.stage("double", numbers, {3, false, 8, 16}, [](long x) { return 2 * x; });
+    atomic<long> sum(0);
+    atomic<long> count(0);
+    p.sink("sum", doubled, {2, false, 8, 16}, [&sum, &count](long x) {
+        sum += x;
+        count++;
+    });
+    p.run();
+
+    assert(count == n);
+    assert(sum == n * (n - 1));
+    cout << "Unordered pipeline test passed" << endl;
+}
+
+// A slow stage in the middle shows up as busy with a full input channel.
+void reportBottleneck() {
+    Pipeline p;
+    int next = 0;
+    auto ids = p.source<int>("read", {1, false, 1, 32}, [&next](int& out) {
+        out = next++;
+        return out < 2000;
+    });
+    auto enriched = p.stage("enrich", ids, {2, false, 4, 32}, [](int x) {
+        this_thread::sleep_for(chrono::microseconds(200));
+        return x;
+    });
+    p.sink("persist", enriched, {1, false, 16, 32}, [](int) {});
+    p.run();
+    p.report(cout);
+}
+
+int main() {
+    testOrdered();
+    testUnordered();
+    reportBottleneck();
+}
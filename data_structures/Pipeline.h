@@ -0,0 +1,360 @@
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <functional>
+#include <chrono>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+
+#include "EventCount.h"
+
+/*
+Pipeline of stages connected by bounded channels:
+
+    source --[chan]--> transform x N workers --[chan]--> ... --[chan]--> sink x M workers
+
+1. Every stage owns its worker threads and its output channel. A full channel blocks the stage
+   that feeds it, so a slow stage throttles everything upstream instead of letting memory grow.
+2. Workers move items in batches of up to StageOptions::batch, one channel lock per batch.
+3. The source numbers its items. A stage with ordered = true passes its results through a reorder
+   buffer that releases them in source order, so it can use several workers and still keep order,
+   even behind an unordered stage. Stages are one in, one out, which keeps the numbering dense.
+4. The last worker of a stage to finish closes the stage's output channel, which ends the stream
+   for the next stage once it has drained it.
+5. Each stage counts the items it handled and the time its workers spent in the user function,
+   and each channel remembers its peak depth. A stage that is busy all the time with a full input
+   channel is the bottleneck.
+
+The user functions must not throw.
+*/
+
+struct StageOptions {
+    int workers = 1;
+    bool ordered = false;
+    size_t batch = 16;
+    // Capacity of the channel after this stage.
+    size_t buffer = 1024;
+};
+
+struct StageMetrics {
+    std::string name;
+    long items;
+    double busy_secs;
+    // Input channel of the stage, both 0 for the source.
+    size_t depth;
+    size_t max_depth;
+};
+
+template <typename T>
+class Channel {
+    std::deque<std::pair<long, T> > q_;
+    std::mutex mt_;
+    const size_t capacity_;
+    bool closed_;
+    std::atomic<size_t> depth_;
+    std::atomic<size_t> max_depth_;
+    EventCount not_empty_;
+    EventCount not_full_;
+
+    public:
+
+    explicit Channel(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)), closed_(false), depth_(0), max_depth_(0) {}
+
+    // Blocks while the channel is full. Returns false if it has been closed.
+    bool Push(long seq, T value) {
+        bool pushed = false;
+        Await(not_full_, [&]() {
+            std::lock_guard<std::mutex> lk(mt_);
+            if (closed_) {
+                return true;
+            }
+            if (q_.size() >= capacity_) {
+                return false;
+            }
+            q_.emplace_back(seq, std::move(value));
+            depth_.store(q_.size(), std::memory_order_relaxed);
+            if (q_.size() > max_depth_.load(std::memory_order_relaxed)) {
+                max_depth_.store(q_.size(), std::memory_order_relaxed);
+            }
+            pushed = true;
+            return true;
+        });
+        if (pushed) {
+            not_empty_.NotifyOne();
+        }
+        return pushed;
+    }
+
+    // Blocks until there is something to pop, then moves up to max_n items into out. Returns false
+    // once the channel is closed and drained.
+    bool PopBulk(std::vector<std::pair<long, T> >& out, size_t max_n) {
+        out.clear();
+        Await(not_empty_, [&]() {
+            std::lock_guard<std::mutex> lk(mt_);
+            while (out.size() < max_n && !q_.empty()) {
+                out.push_back(std::move(q_.front()));
+                q_.pop_front();
+            }
+            depth_.store(q_.size(), std::memory_order_relaxed);
+            return !out.empty() || closed_;
+        });
+
+        if (out.empty()) {
+            return false;
+        }
+        if (out.size() == 1) {
+            not_full_.NotifyOne();
+        } else {
+            not_full_.NotifyAll();
+        }
+        return true;
+    }
+
+    void Close() {
+        {
+            std::lock_guard<std::mutex> lk(mt_);
+            closed_ = true;
+        }
+        not_empty_.NotifyAll();
+        not_full_.NotifyAll();
+    }
+
+    size_t depth() {
+        return depth_.load(std::memory_order_relaxed);
+    }
+
+    size_t max_depth() {
+        return max_depth_.load(std::memory_order_relaxed);
+    }
+};
+
+template <typename T>
+using Link = std::shared_ptr<Channel<T> >;
+
+class Pipeline {
+    struct StageBase {
+        std::string name;
+        int workers;
+        std::atomic<long> items;
+        std::atomic<long> busy_ns;
+        std::function<size_t()> depth;
+        std::function<size_t()> max_depth;
+        std::function<void()> work;
+        std::atomic<int> workers_left;
+        std::function<void()> finish;
+
+        StageBase(std::string name, int workers) : name(name), workers(std::max(workers, 1)), items(0), busy_ns(0),
+        depth([]() { return size_t(0); }), max_depth([]() { return size_t(0); }), workers_left(this->workers) {}
+
+        void run() {
+            work();
+            if (--workers_left == 0 && finish) {
+                finish();
+            }
+        }
+    };
+
+    // Releases results of an ordered stage in sequence order.
+    template <typename T>
+    class Reorder {
+        std::mutex mt_;
+        std::map<long, T> pending_;
+        long next_;
+
+        public:
+
+        Reorder() : next_(0) {}
+
+        void Emit(std::vector<std::pair<long, T> >& batch, Channel<T>& out) {
+            std::lock_guard<std::mutex> lk(mt_);
+            for (auto& item : batch) {
+                pending_.emplace(item.first, std::move(item.second));
+            }
+            // Pushing under the lock keeps the order, a worker that can not emit has nothing better
+            // to do than wait for the one that can.
+            while (!pending_.empty() && pending_.begin()->first == next_) {
+                out.Push(next_, std::move(pending_.begin()->second));
+                pending_.erase(pending_.begin());
+                next_++;
+            }
+        }
+    };
+
+    std::vector<std::unique_ptr<StageBase> > stages_;
+    std::vector<std::thread> threads_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point end_;
+    bool finished_;
+
+    StageBase& addStage(std::string name, int workers) {
+        stages_.push_back(std::unique_ptr<StageBase>(new StageBase(name, workers)));
+        return *stages_.back();
+    }
+
+    template <typename In>
+    static void watchInput(StageBase& stage, Link<In> in) {
+        stage.depth = [in]() { return in->depth(); };
+        stage.max_depth = [in]() { return in->max_depth(); };
+    }
+
+    static long elapsedNs(std::chrono::steady_clock::time_point since) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+
+    public:
+
+    Pipeline() : finished_(false) {}
+
+    Pipeline(const Pipeline& other) = delete;
+    Pipeline& operator=(const Pipeline& other) = delete;
+
+    ~Pipeline() {
+        wait();
+    }
+
+    // next(out) fills out and returns true, or returns false at the end of the stream. Runs on one
+    // thread, only opts.buffer is used.
+    template <typename T, typename Next>
+    Link<T> source(std::string name, StageOptions opts, Next next) {
+        Link<T> out = std::make_shared<Channel<T> >(opts.buffer);
+        StageBase& node = addStage(name, 1);
+        node.work = [&node, out, next]() mutable {
+            long seq = 0;
+            T value;
+            while (true) {
+                auto begin = std::chrono::steady_clock::now();
+                bool more = next(value);
+                node.busy_ns += elapsedNs(begin);
+                if (!more || !out->Push(seq++, std::move(value))) {
+                    break;
+                }
+                node.items++;
+            }
+        };
+        node.finish = [out]() { out->Close(); };
+        return out;
+    }
+
+    // Runs fn on every item of in with opts.workers threads and returns the channel of the results.
+    template <typename In, typename Fn, typename Out = typename std::invoke_result<Fn, In>::type>
+    Link<Out> stage(std::string name, Link<In> in, StageOptions opts, Fn fn) {
+        Link<Out> out = std::make_shared<Channel<Out> >(opts.buffer);
+        std::shared_ptr<Reorder<Out> > reorder;
+        if (opts.ordered) {
+            reorder = std::make_shared<Reorder<Out> >();
+        }
+
+        StageBase& node = addStage(name, opts.workers);
+        watchInput(node, in);
+        size_t batch_sz = std::max<size_t>(opts.batch, 1);
+        node.work = [&node, in, out, reorder, batch_sz, fn]() mutable {
+            std::vector<std::pair<long, In> > batch;
+            std::vector<std::pair<long, Out> > results;
+            while (in->PopBulk(batch, batch_sz)) {
+                auto begin = std::chrono::steady_clock::now();
+                results.clear();
+                for (auto& item : batch) {
+                    results.emplace_back(item.first, fn(std::move(item.second)));
+                }
+                node.busy_ns += elapsedNs(begin);
+                node.items += batch.size();
+
+                if (reorder) {
+                    reorder->Emit(results, *out);
+                } else {
+                    for (auto& result : results) {
+                        out->Push(result.first, std::move(result.second));
+                    }
+                }
+            }
+        };
+        node.finish = [out]() { out->Close(); };
+        return out;
+    }
+
+    // Runs fn on every item of in with opts.workers threads. Order only holds with one worker.
+    template <typename In, typename Fn>
+    void sink(std::string name, Link<In> in, StageOptions opts, Fn fn) {
+        StageBase& node = addStage(name, opts.workers);
+        watchInput(node, in);
+        size_t batch_sz = std::max<size_t>(opts.batch, 1);
+        node.work = [&node, in, batch_sz, fn]() mutable {
+            std::vector<std::pair<long, In> > batch;
+            while (in->PopBulk(batch, batch_sz)) {
+                auto begin = std::chrono::steady_clock::now();
+                for (auto& item : batch) {
+                    fn(std::move(item.second));
+                }
+                node.busy_ns += elapsedNs(begin);
+                node.items += batch.size();
+            }
+        };
+    }
+
+    void start() {
+        start_ = std::chrono::steady_clock::now();
+        for (auto& stage : stages_) {
+            for (int i = 0; i < stage->workers; i++) {
+                threads_.push_back(std::thread(&StageBase::run, stage.get()));
+            }
+        }
+    }
+
+    // Waits until the source is exhausted and every stage has drained its input.
+    void wait() {
+        for (auto& t : threads_) {
+            t.join();
+        }
+        if (!threads_.empty()) {
+            end_ = std::chrono::steady_clock::now();
+            finished_ = true;
+        }
+        threads_.clear();
+    }
+
+    void run() {
+        start();
+        wait();
+    }
+
+    // Safe to call while the pipeline runs.
+    std::vector<StageMetrics> metrics() {
+        std::vector<StageMetrics> res;
+        for (auto& stage : stages_) {
+            res.push_back({stage->name, stage->items.load(), stage->busy_ns.load() / 1e9, stage->depth(),
+                           stage->max_depth()});
+        }
+        return res;
+    }
+
+    double elapsedSecs() {
+        auto end = finished_ ? end_ : std::chrono::steady_clock::now();
+        return std::chrono::duration<double>(end - start_).count();
+    }
+
+    void report(std::ostream& os) {
+        double secs = elapsedSecs();
+        os << std::left << std::setw(12) << "stage" << std::right << std::setw(10) << "items"
+           << std::setw(14) << "items/s" << std::setw(8) << "busy%" << std::setw(8) << "depth"
+           << std::setw(10) << "max depth" << "\n";
+        std::vector<StageMetrics> all = metrics();
+        for (size_t i = 0; i < all.size(); i++) {
+            const StageMetrics& m = all[i];
+            double busy = secs > 0 ? 100.0 * m.busy_secs / (secs * stages_[i]->workers) : 0;
+            os << std::left << std::setw(12) << m.name << std::right << std::setw(10) << m.items
+               << std::setw(14) << std::fixed << std::setprecision(0) << (secs > 0 ? m.items / secs : 0)
+               << std::setw(8) << std::setprecision(1) << busy << std::setw(8) << m.depth
+               << std::setw(10) << m.max_depth << "\n";
+        }
+    }
+};
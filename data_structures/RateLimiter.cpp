@@ -0,0 +1,274 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <cassert>
+
+#include "TimedScheduler.h"
+
+using namespace std;
+
+/*
+Token bucket rate limiter.
+
+There is no refill thread. The bucket is stored as a single "theoretical arrival time" (tat), the
+point in time at which the bucket would be full again (GCRA formulation of a token bucket):
+
+    emission interval  T   = 1s / rate      (time it takes to earn one token)
+    burst tolerance    tau = capacity * T   (how far ahead of now tat may run)
+
+Taking n tokens moves tat to max(tat, now) + n * T, and is only allowed if that new tat is at most
+tau ahead of now. The tokens currently available are (now + tau - tat) / T, so the refill happens
+lazily each time the clock is read.
+
+Because the whole state is one int64, try_acquire is a clock read plus a CAS loop. No lock is ever
+taken, and a failed check does not write anything.
+
+acquire(n) does not block a thread. When tokens are short it computes when they will be available
+and asks the TimedScheduler to retry at that point, returning a future that becomes ready once the
+tokens have been taken.
+*/
+class RateLimiter {
+    using Clock = std::chrono::steady_clock;
+
+    // The bucket itself. A pending retry holds it through a weak_ptr, not the limiter through this:
+    // if the limiter is destroyed first, the retry finds the state gone and fails its future.
+    struct State {
+        long interval_ns;
+        long tolerance_ns;
+        long capacity;
+        atomic<long> tat;
+        Clock::time_point epoch;
+
+        State(double rate, long cap) :
+        interval_ns(max(1L, static_cast<long>(1e9 / rate))),
+        tolerance_ns(cap * interval_ns),
+        capacity(cap),
+        tat(0),
+        epoch(Clock::now()) {}
+
+        long now_ns() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count();
+        }
+
+        // Time in ns until n tokens can be taken, 0 if they can be taken now.
+        long wait_ns(long n) {
+            long now = now_ns();
+            long cur = tat.load(memory_order_relaxed);
+            long new_tat = max(cur, now) + n * interval_ns;
+            return max(0L, new_tat - tolerance_ns - now);
+        }
+
+        bool try_acquire(long n) {
+            if (n > capacity) {
+                return false;
+            }
+
+            long now = now_ns();
+            long cur = tat.load(memory_order_relaxed);
+            while (true) {
+                long new_tat = max(cur, now) + n * interval_ns;
+                if (new_tat - now > tolerance_ns) {
+                    return false;
+                }
+
+                if (tat.compare_exchange_weak(cur, new_tat, memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+    };
+
+    Scheduler& sch_;
+    shared_ptr<State> state_;
+
+    static void retry(Scheduler& sch, weak_ptr<State> weak, shared_ptr<promise<void> > prom, long n) {
+        shared_ptr<State> state = weak.lock();
+        if (!state) {
+            prom->set_exception(make_exception_ptr(std::runtime_error("RateLimiter destroyed before the tokens were available")));
+            return;
+        }
+        if (state->try_acquire(n)) {
+            prom->set_value();
+            return;
+        }
+
+        // The scheduler works in milliseconds, round up so we never wake before the tokens exist.
+        long delay_ms = (state->wait_ns(n) + 999999) / 1000000;
+        sch.schedule([&sch, weak, prom, n]() { retry(sch, weak, prom, n); }, max(1L, delay_ms));
+    }
+
+    public:
+
+    // rate is in tokens per second and at most 1e9, capacity is the burst size.
+    RateLimiter(Scheduler& sch, double rate, long capacity) :
+    sch_(sch),
+    state_(make_shared<State>(rate, capacity)) {}
+
+    RateLimiter(const RateLimiter& other) = delete;
+    RateLimiter& operator=(const RateLimiter& other) = delete;
+
+    bool try_acquire(long n = 1) {
+        return state_->try_acquire(n);
+    }
+
+    // The future fails with runtime_error if the limiter is destroyed before the tokens came in.
+    future<void> acquire(long n = 1) {
+        if (n > state_->capacity) {
+            throw std::invalid_argument("Requested more tokens than the bucket can hold");
+        }
+
+        shared_ptr<promise<void> > prom = make_shared<promise<void> >();
+        auto result = prom->get_future();
+        retry(sch_, state_, prom, n);
+        return result;
+    }
+
+    long available() {
+        long now = state_->now_ns();
+        long tat = max(state_->tat.load(memory_order_relaxed), now);
+        return (now + state_->tolerance_ns - tat) / state_->interval_ns;
+    }
+};
+
+void TestBurstAndRefill() {
+    Scheduler sch;
+    RateLimiter limiter(sch, 1000, 10);
+
+    // The bucket starts full.
+    int taken = 0;
+    for (int i = 0; i < 10; i++) {
+        taken += limiter.try_acquire();
+    }
+    assert(taken == 10);
+    bool took = limiter.try_acquire();
+    assert(!took);
+    took = limiter.try_acquire(11);
+    assert(!took);
+
+    // 1000 tokens/s refills the whole bucket in 10 ms.
+    this_thread::sleep_for(std::chrono::milliseconds(15));
+    took = limiter.try_acquire(10);
+    assert(took);
+    took = limiter.try_acquire();
+    assert(!took);
+
+    sch.shutdown();
+    cout << "Burst and refill test passed" << endl;
+}
+
+void TestAsyncAcquire() {
+    Scheduler sch;
+    RateLimiter limiter(sch, 100, 5);
+    bool took = limiter.try_acquire(5);
+    assert(took);
+
+    // Nothing left, so each acquire has to wait for the bucket to earn tokens.
+    auto start = std::chrono::steady_clock::now();
+    vector<future<void> > waits;
+    for (int i = 0; i < 3; i++) {
+        waits.push_back(limiter.acquire(2));
+    }
+    for (auto& w : waits) {
+        w.get();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // 6 tokens at 100/s is at least 60 ms.
+    assert(elapsed >= std::chrono::milliseconds(55));
+
+    sch.shutdown();
+    cout << "Async acquire test passed" << endl;
+}
+
+// A retry still queued in the scheduler when the limiter goes away must not touch the limiter.
+void TestDestroyWithPendingAcquire() {
+    Scheduler sch;
+    future<void> pending;
+    {
+        RateLimiter limiter(sch, 10, 1);
+        bool took = limiter.try_acquire();
+        assert(took);
+        // The next token is 100 ms away, the limiter is gone long before that.
+        pending = limiter.acquire();
+    }
+    bool failed = false;
+    try {
+        pending.get();
+    } catch (const std::runtime_error&) {
+        failed = true;
+    }
+    assert(failed);
+
+    sch.shutdown();
+    cout << "Destroy with pending acquire test passed" << endl;
+}
+
+// Shutting the scheduler down must not wait for (or run) a retry that is not due yet.
+void TestShutdownWithPendingRetry() {
+    future<void> pending;
+    auto start = std::chrono::steady_clock::now();
+    {
+        Scheduler sch;
+        RateLimiter limiter(sch, 1, 1);
+        bool took = limiter.try_acquire();
+        assert(took);
+        // The next token is a second away.
+        pending = limiter.acquire();
+        // Let the poll thread settle into waiting for the retry.
+        this_thread::sleep_for(std::chrono::milliseconds(20));
+        sch.shutdown();
+    }
+    assert(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(500));
+    // The retry was dropped with the scheduler, the promise is broken.
+    bool failed = false;
+    try {
+        pending.get();
+    } catch (const future_error&) {
+        failed = true;
+    }
+    assert(failed);
+    cout << "Shutdown with pending retry test passed" << endl;
+}
+
+void BenchTryAcquire(int num_threads) {
+    Scheduler sch;
+    // Large enough that the bench measures the check, not the rejection path only.
+    RateLimiter limiter(sch, 1e8, 1000000);
+    int iters = 2000000;
+
+    atomic<long> admitted(0);
+    vector<thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+        threads.push_back(thread([&]() {
+            long local = 0;
+            for (int i = 0; i < iters; i++) {
+                local += limiter.try_acquire();
+            }
+            admitted += local;
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    cout << num_threads << " threads: " << (num_threads * iters / secs / 1e6) << " M checks/s, "
+         << admitted << " admitted" << endl;
+    sch.shutdown();
+}
+
+int main() {
+    TestBurstAndRefill();
+    TestAsyncAcquire();
+    TestDestroyWithPendingAcquire();
+    TestShutdownWithPendingRetry();
+    for (int t : {1, 2, 4}) {
+        BenchTryAcquire(t);
+    }
+}
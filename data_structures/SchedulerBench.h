@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+Latency benchmark shared by TimedScheduler.cpp, TaskScheduler.cpp and TaskSchedulerSimple.cpp.
+
+Each scheduler file provides an adapter with the following shape and calls RunSuite from its main
+when started with --bench:
+
+struct Adapter {
+    static const char* name();
+    void start(int workers);
+    // Duration the scheduler actually honours for a requested delay (its time unit may be coarse).
+    std::chrono::nanoseconds round(std::chrono::nanoseconds delay);
+    void arm(std::function<void()> job, std::chrono::nanoseconds delay);
+    // Arms a fixed-rate timer, returns false if the scheduler cannot run periodic timers.
+    bool armPeriodic(std::function<void()> job, std::chrono::nanoseconds delay, std::chrono::nanoseconds period);
+    void stop();
+};
+
+None of the schedulers support cancellation, so cancel throughput is reported as null.
+*/
+
+namespace sched_bench {
+
+using Clock = std::chrono::system_clock;
+using Ns = std::chrono::nanoseconds;
+
+struct Config {
+    int timers = 1000;
+    int workers = 1;
+    int load_threads = 0;
+    Ns delay = std::chrono::milliseconds(50);
+    Ns period = std::chrono::milliseconds(50);
+    int periodic_timers = 10;
+    int periodic_fires = 5;
+    Ns idle_window = std::chrono::milliseconds(500);
+};
+
+struct Result {
+    std::string name;
+    Config cfg;
+    long fired = 0;
+    long expected = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+    double p999_us = 0;
+    double wakeups_per_sec = 0;
+    double idle_cpu_pct = 0;
+    double idle_wakeups_per_sec = 0;
+    double insert_per_sec = 0;
+    bool periodic_supported = true;
+};
+
+inline double ProcessCpuSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Voluntary + involuntary context switches of the whole process, used as a proxy for wakeups.
+inline long ContextSwitches() {
+    rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+inline double Percentile(std::vector<long>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()));
+    return sorted[idx] / 1000.0;
+}
+
+// Collects firing lateness from scheduler threads without taking a lock per sample.
+class LatenessLog {
+    std::vector<long> samples_;
+    std::atomic<long> next_;
+
+    public:
+
+    explicit LatenessLog(long capacity) : samples_(capacity), next_(0) {}
+
+    void record(Clock::time_point expected) {
+        long idx = next_.fetch_add(1);
+        if (idx < static_cast<long>(samples_.size())) {
+            samples_[idx] = std::chrono::duration_cast<Ns>(Clock::now() - expected).count();
+        }
+    }
+
+    long count() const {
+        return std::min<long>(next_.load(), samples_.size());
+    }
+
+    std::vector<long> sorted() const {
+        std::vector<long> out(samples_.begin(), samples_.begin() + count());
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+};
+
+template <typename Adapter>
+Result Run(const Config& cfg) {
+    Result res;
+    res.name = Adapter::name();
+    res.cfg = cfg;
+
+    std::atomic_bool load_done(false);
+    std::vector<std::thread> load;
+    for (int i = 0; i < cfg.load_threads; i++) {
+        load.emplace_back([&load_done]() {
+            while (!load_done.load(std::memory_order_relaxed)) {}
+        });
+    }
+
+    Adapter sched;
+    sched.start(cfg.workers);
+
+    // Idle phase: nothing armed, any CPU or wakeups here are pure overhead.
+    double cpu_before = ProcessCpuSeconds();
+    long csw_before = ContextSwitches();
+    std::this_thread::sleep_for(cfg.idle_window);
+    double idle_secs = std::chrono::duration<double>(cfg.idle_window).count();
+    double idle_cpu = ProcessCpuSeconds() - cpu_before;
+    if (cfg.load_threads == 0) {
+        res.idle_cpu_pct = 100.0 * idle_cpu / idle_secs;
+        res.idle_wakeups_per_sec = (ContextSwitches() - csw_before) / idle_secs;
+    } else {
+        // Spinning load threads dominate the process counters, idle overhead is not measurable.
+        res.idle_cpu_pct = -1;
+        res.idle_wakeups_per_sec = -1;
+    }
+
+    res.expected = cfg.timers + static_cast<long>(cfg.periodic_timers) * cfg.periodic_fires;
+    auto log = std::make_shared<LatenessLog>(res.expected);
+
+    csw_before = ContextSwitches();
+    auto window_start = Clock::now();
+
+    Ns delay = sched.round(cfg.delay);
+    Ns period = sched.round(cfg.period);
+    Ns max_wait = delay + period * cfg.periodic_fires;
+
+    auto insert_start = std::chrono::steady_clock::now();
+    for (int i = 0; i < cfg.timers; i++) {
+        auto expected = Clock::now() + delay;
+        sched.arm([log, expected]() { log->record(expected); }, cfg.delay);
+    }
+    double insert_secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - insert_start).count();
+    res.insert_per_sec = insert_secs > 0 ? cfg.timers / insert_secs : 0;
+
+    for (int i = 0; i < cfg.periodic_timers; i++) {
+        auto first = Clock::now() + delay;
+        auto fires = std::make_shared<std::atomic<int> >(0);
+        int limit = cfg.periodic_fires;
+        bool armed = sched.armPeriodic([log, first, period, fires, limit]() {
+            int k = fires->fetch_add(1);
+            if (k < limit) {
+                log->record(first + period * k);
+            }
+        }, cfg.delay, cfg.period);
+
+        if (!armed) {
+            res.periodic_supported = false;
+            res.expected = cfg.timers;
+            break;
+        }
+    }
+
+    auto deadline = Clock::now() + max_wait + std::chrono::seconds(5);
+    while (log->count() < res.expected && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double window_secs = std::chrono::duration<double>(Clock::now() - window_start).count();
+    res.wakeups_per_sec = (ContextSwitches() - csw_before) / window_secs;
+
+    sched.stop();
+    load_done = true;
+    for (auto& t : load) {
+        t.join();
+    }
+
+    auto sorted = log->sorted();
+    res.fired = sorted.size();
+    res.p50_us = Percentile(sorted, 0.50);
+    res.p99_us = Percentile(sorted, 0.99);
+    res.p999_us = Percentile(sorted, 0.999);
+    return res;
+}
+
+inline void PrintJson(const Result& r, bool last) {
+    printf("  {\"scheduler\": \"%s\", \"timers\": %d, \"periodic_timers\": %d, \"workers\": %d, "
+           "\"load_threads\": %d, \"fired\": %ld, \"expected\": %ld, \"periodic_supported\": %s, "
+           "\"lateness_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f}, "
+           "\"wakeups_per_sec\": %.1f, \"idle_cpu_pct\": %.2f, \"idle_wakeups_per_sec\": %.1f, "
+           "\"insert_per_sec\": %.0f, \"cancel_per_sec\": null}%s\n",
+           r.name.c_str(), r.cfg.timers, r.cfg.periodic_timers, r.cfg.workers, r.cfg.load_threads,
+           r.fired, r.expected, r.periodic_supported ? "true" : "false",
+           r.p50_us, r.p99_us, r.p999_us, r.wakeups_per_sec, r.idle_cpu_pct, r.idle_wakeups_per_sec,
+           r.insert_per_sec, last ? "" : ",");
+}
+
+// Runs the default matrix of worker counts and background load and prints a JSON array.
+template <typename Adapter>
+void RunSuite(int timers) {
+    std::vector<int> workers = {1, 2, 4};
+    std::vector<int> loads = {0, static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))};
+
+    std::vector<Result> results;
+    for (int w : workers) {
+        for (int l : loads) {
+            Config cfg;
+            cfg.timers = timers;
+            cfg.workers = w;
+            cfg.load_threads = l;
+            results.push_back(Run<Adapter>(cfg));
+        }
+    }
+
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        PrintJson(results[i], i + 1 == results.size());
+    }
+    printf("]\n");
+}
+
+} // namespace sched_bench
@@ -0,0 +1,298 @@
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <optional>
+#include <type_traits>
+#include <chrono>
+#include <cassert>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+Unbounded queue stored in fixed size segments.
+
+The linked list in FineGrainedThreadSafeQueue.cpp costs one node (and one allocation) per element,
+and walking it is a pointer chase per element. Here elements sit next to each other in arrays of
+SegmentSize slots, and segments are linked together:
+
+    head_seg_ [x x x . . .] -> [. . . . . .] -> tail_seg_ [. . . . ]
+                     ^ head_idx_                                ^ tail_idx_
+
+1. Like the fine grained queue, producers only take tail_mt_ and consumers only head_mt_.
+2. The producer publishes a slot by bumping the segment's committed count (release), the consumer
+   reads that count (acquire) to know how far it may go. A segment is linked before the first slot
+   in it is written, so a consumer that finished a segment finds the next one through next.
+3. A segment the consumer has finished goes to a small spare pool and the producer reuses it, so in
+   steady state there is one allocation per SegmentSize elements at most, usually none.
+4. Waiting consumers park on an EventCount.
+
+Values are moved in and out, T has to be nothrow move constructible so a pop can not throw after
+the slot is consumed (same argument as PooledThreadSafeQueue).
+*/
+template <typename T, size_t SegmentSize = 256>
+class SegmentedQueue {
+    static_assert(SegmentSize >= 64 && SegmentSize <= 1024, "Segments hold 64 to 1024 slots");
+    static_assert(std::is_nothrow_move_constructible<T>::value,
+                  "SegmentedQueue hands values out by move and needs it not to throw");
+
+    struct Segment {
+        typename aligned_storage<sizeof(T), alignof(T)>::type slots[SegmentSize];
+        atomic<size_t> committed;
+        atomic<Segment*> next;
+
+        Segment() : committed(0), next(nullptr) {}
+
+        T* slot(size_t i) {
+            return reinterpret_cast<T*>(&slots[i]);
+        }
+    };
+
+    // Consumer side.
+    alignas(64) mutex head_mt_;
+    Segment* head_seg_;
+    size_t head_idx_;
+
+    // Producer side.
+    alignas(64) mutex tail_mt_;
+    Segment* tail_seg_;
+    size_t tail_idx_;
+
+    alignas(64) mutex spare_mt_;
+    vector<Segment*> spare_;
+    size_t max_spare_;
+    atomic<long> allocated_;
+
+    atomic<long> sz_;
+    EventCount not_empty_;
+
+    Segment* acquireSegment() {
+        {
+            lock_guard<mutex> lk(spare_mt_);
+            if (!spare_.empty()) {
+                Segment* seg = spare_.back();
+                spare_.pop_back();
+                return seg;
+            }
+        }
+        Segment* seg = new Segment();
+        allocated_++;
+        return seg;
+    }
+
+    void retireSegment(Segment* seg) {
+        seg->committed.store(0, memory_order_relaxed);
+        seg->next.store(nullptr, memory_order_relaxed);
+        {
+            lock_guard<mutex> lk(spare_mt_);
+            if (spare_.size() < max_spare_) {
+                spare_.push_back(seg);
+                return;
+            }
+        }
+        delete seg;
+        allocated_--;
+    }
+
+    // Call holding head_mt_. Returns the front slot, or nullptr if the queue is empty.
+    T* frontLocked() {
+        if (head_idx_ == SegmentSize) {
+            Segment* next = head_seg_->next.load(memory_order_acquire);
+            if (!next) {
+                return nullptr;
+            }
+            retireSegment(head_seg_);
+            head_seg_ = next;
+            head_idx_ = 0;
+        }
+
+        if (head_idx_ == head_seg_->committed.load(memory_order_acquire)) {
+            return nullptr;
+        }
+        return head_seg_->slot(head_idx_);
+    }
+
+    // Call holding head_mt_ after the value in slot has been moved out.
+    void popFront(T* slot) {
+        slot->~T();
+        head_idx_++;
+        sz_.fetch_sub(1, memory_order_relaxed);
+    }
+
+    public:
+
+    explicit SegmentedQueue(size_t max_spare_segments = 4) :
+    head_seg_(new Segment()),
+    head_idx_(0),
+    tail_seg_(head_seg_),
+    tail_idx_(0),
+    max_spare_(max_spare_segments),
+    allocated_(1),
+    sz_(0) {}
+
+    SegmentedQueue(const SegmentedQueue& other) = delete;
+    SegmentedQueue& operator=(const SegmentedQueue& other) = delete;
+
+    ~SegmentedQueue() {
+        while (T* slot = frontLocked()) {
+            popFront(slot);
+        }
+        delete head_seg_;
+        for (Segment* seg : spare_) {
+            delete seg;
+        }
+    }
+
+    void Push(T new_val) {
+        {
+            lock_guard<mutex> lk(tail_mt_);
+            if (tail_idx_ == SegmentSize) {
+                // Only allocation point, nothing has been modified if it throws.
+                Segment* seg = acquireSegment();
+                tail_seg_->next.store(seg, memory_order_release);
+                tail_seg_ = seg;
+                tail_idx_ = 0;
+            }
+            new (tail_seg_->slot(tail_idx_)) T(std::move(new_val));
+            tail_idx_++;
+            tail_seg_->committed.store(tail_idx_, memory_order_release);
+        }
+        sz_.fetch_add(1, memory_order_relaxed);
+        not_empty_.NotifyOne();
+    }
+
+    bool TryPop(T& value) {
+        lock_guard<mutex> lk(head_mt_);
+        T* slot = frontLocked();
+        if (!slot) {
+            return false;
+        }
+        value = std::move(*slot);
+        popFront(slot);
+        return true;
+    }
+
+    optional<T> TryPopValue() {
+        lock_guard<mutex> lk(head_mt_);
+        T* slot = frontLocked();
+        if (!slot) {
+            return nullopt;
+        }
+        optional<T> value(std::move(*slot));
+        popFront(slot);
+        return value;
+    }
+
+    void WaitAndPop(T& value) {
+        while (!TryPop(value)) {
+            uint32_t key = not_empty_.PrepareWait();
+            if (TryPop(value)) {
+                not_empty_.CancelWait();
+                return;
+            }
+            not_empty_.Wait(key);
+        }
+    }
+
+    long sz() {
+        return sz_.load(memory_order_relaxed);
+    }
+
+    // Segments currently owned by the queue, in use or spare.
+    long segments() {
+        return allocated_.load();
+    }
+};
+
+void testOrderAndRecycling() {
+    SegmentedQueue<int, 64> q(2);
+
+    // Keep the queue around 100 elements, the segments must be reused, not reallocated.
+    for (int i = 0; i < 100; i++) {
+        q.Push(i);
+    }
+    int next_pop = 0;
+    for (int i = 100; i < 100000; i++) {
+        q.Push(i);
+        int val;
+        bool popped = q.TryPop(val);
+        assert(popped && val == next_pop);
+        next_pop++;
+    }
+    assert(q.segments() <= 5);
+
+    while (auto val = q.TryPopValue()) {
+        assert(*val == next_pop);
+        next_pop++;
+    }
+    assert(next_pop == 100000);
+    assert(q.sz() == 0);
+    cout << "Order and recycling test passed" << endl;
+}
+
+void testConcurrent() {
+    SegmentedQueue<long> q;
+    const int producers = 4;
+    const long per_producer = 50000;
+
+    vector<thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.push_back(thread([&q, p, per_producer]() {
+            for (long i = 0; i < per_producer; i++) {
+                q.Push(p * per_producer + i);
+            }
+        }));
+    }
+
+    atomic<long> sum(0);
+    for (int c = 0; c < 2; c++) {
+        threads.push_back(thread([&q, &sum, producers, per_producer]() {
+            vector<long> last(producers, -1);
+            long local = 0;
+            for (long i = 0; i < producers * per_producer / 2; i++) {
+                long v;
+                q.WaitAndPop(v);
+                assert(v > last[v / per_producer]);
+                last[v / per_producer] = v;
+                local += v;
+            }
+            sum += local;
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    long n = producers * per_producer;
+    assert(sum == n * (n - 1) / 2);
+    cout << "Concurrent test passed" << endl;
+}
+
+void bench() {
+    SegmentedQueue<int> q;
+    const long n = 5000000;
+    auto start = std::chrono::steady_clock::now();
+    thread producer([&q, n]() {
+        for (long i = 0; i < n; i++) {
+            q.Push(i);
+        }
+    });
+    int val;
+    for (long i = 0; i < n; i++) {
+        q.WaitAndPop(val);
+    }
+    producer.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "1 producer / 1 consumer: " << (2 * n / secs / 1e6) << " M ops/s, "
+         << q.segments() << " segments" << endl;
+}
+
+int main() {
+    testOrderAndRecycling();
+    testConcurrent();
+    bench();
+}
@@ -0,0 +1,326 @@
+#include <iostream>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cassert>
+
+#include "EventCount.h"
+
+using namespace std;
+
+const size_t cache_line_size = 64;
+
+/*
+Bounded single producer / single consumer ring buffer.
+
+1. Capacity is rounded up to a power of two so a slot is picked with a mask instead of a modulo.
+   head_ and tail_ are free running counters, the number of elements is tail_ - head_.
+2. head_ is only written by the consumer and tail_ only by the producer. They live on separate cache
+   lines so the two threads do not invalidate each other's line on every operation.
+3. Each side keeps a private copy of the other side's index (cached_head_ / cached_tail_) and only
+   reloads the shared one when the copy says the ring is full / empty. In steady state an operation
+   touches no cache line owned by the other thread.
+4. The batch variants publish one index update for the whole batch.
+5. Blocking variants park on an EventCount (futex) and the other side only issues a wake when a
+   thread is actually parked.
+
+Only one thread may call the producer methods and only one thread the consumer methods.
+*/
+template <typename T>
+class SpscRingBuffer {
+    private:
+
+    const size_t mask_;
+    unique_ptr<T[]> slots_;
+
+    // Consumer side.
+    alignas(cache_line_size) atomic<size_t> head_;
+    size_t cached_tail_;
+
+    // Producer side.
+    alignas(cache_line_size) atomic<size_t> tail_;
+    size_t cached_head_;
+
+    alignas(cache_line_size) EventCount not_empty_;
+    EventCount not_full_;
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 1;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    size_t capacity() const {
+        return mask_ + 1;
+    }
+
+    // Producer: free slots, refreshing the consumer index only when the cached one is exhausted.
+    size_t freeSlots(size_t tail, size_t want) {
+        size_t free = capacity() - (tail - cached_head_);
+        if (free < want) {
+            cached_head_ = head_.load(memory_order_acquire);
+            free = capacity() - (tail - cached_head_);
+        }
+        return free;
+    }
+
+    // Consumer: filled slots, refreshing the producer index only when the cached one is exhausted.
+    size_t filledSlots(size_t head, size_t want) {
+        size_t filled = cached_tail_ - head;
+        if (filled < want) {
+            cached_tail_ = tail_.load(memory_order_acquire);
+            filled = cached_tail_ - head;
+        }
+        return filled;
+    }
+
+    public:
+
+    explicit SpscRingBuffer(size_t capacity) :
+    mask_(roundUp(max<size_t>(capacity, 2)) - 1),
+    slots_(new T[mask_ + 1]),
+    head_(0),
+    cached_tail_(0),
+    tail_(0),
+    cached_head_(0) {}
+
+    SpscRingBuffer(const SpscRingBuffer& other) = delete;
+    SpscRingBuffer& operator=(const SpscRingBuffer& other) = delete;
+
+    // value is only moved from if the push succeeds, a full ring leaves it to the caller.
+    bool TryPush(T&& value) {
+        size_t tail = tail_.load(memory_order_relaxed);
+        if (freeSlots(tail, 1) == 0) {
+            return false;
+        }
+        slots_[tail & mask_] = std::move(value);
+        tail_.store(tail + 1, memory_order_release);
+        not_empty_.NotifyOne();
+        return true;
+    }
+
+    // Moves up to n items from items, returns how many were pushed.
+    size_t TryPushBulk(T* items, size_t n) {
+        size_t tail = tail_.load(memory_order_relaxed);
+        n = min(n, freeSlots(tail, n));
+        for (size_t i = 0; i < n; i++) {
+            slots_[(tail + i) & mask_] = std::move(items[i]);
+        }
+        if (n > 0) {
+            tail_.store(tail + n, memory_order_release);
+            not_empty_.NotifyOne();
+        }
+        return n;
+    }
+
+    void Push(T value) {
+        while (!TryPush(std::move(value))) {
+            uint32_t key = not_full_.PrepareWait();
+            if (freeSlots(tail_.load(memory_order_relaxed), 1) > 0) {
+                not_full_.CancelWait();
+                continue;
+            }
+            not_full_.Wait(key);
+        }
+    }
+
+    // Blocks until all n items are pushed.
+    void PushBulk(T* items, size_t n) {
+        while (n > 0) {
+            size_t pushed = TryPushBulk(items, n);
+            items += pushed;
+            n -= pushed;
+            if (pushed == 0) {
+                uint32_t key = not_full_.PrepareWait();
+                if (freeSlots(tail_.load(memory_order_relaxed), 1) > 0) {
+                    not_full_.CancelWait();
+                    continue;
+                }
+                not_full_.Wait(key);
+            }
+        }
+    }
+
+    bool TryPop(T& value) {
+        size_t head = head_.load(memory_order_relaxed);
+        if (filledSlots(head, 1) == 0) {
+            return false;
+        }
+        value = std::move(slots_[head & mask_]);
+        head_.store(head + 1, memory_order_release);
+        not_full_.NotifyOne();
+        return true;
+    }
+
+    // Moves up to max_n items into out, returns how many were popped.
+    size_t TryPopBulk(T* out, size_t max_n) {
+        size_t head = head_.load(memory_order_relaxed);
+        size_t n = min(max_n, filledSlots(head, max_n));
+        for (size_t i = 0; i < n; i++) {
+            out[i] = std::move(slots_[(head + i) & mask_]);
+        }
+        if (n > 0) {
+            head_.store(head + n, memory_order_release);
+            not_full_.NotifyOne();
+        }
+        return n;
+    }
+
+    void WaitAndPop(T& value) {
+        while (!TryPop(value)) {
+            uint32_t key = not_empty_.PrepareWait();
+            if (filledSlots(head_.load(memory_order_relaxed), 1) > 0) {
+                not_empty_.CancelWait();
+                continue;
+            }
+            not_empty_.Wait(key);
+        }
+    }
+
+    // Blocks until at least one item is available, then pops up to max_n.
+    size_t PopBulk(T* out, size_t max_n) {
+        while (true) {
+            size_t n = TryPopBulk(out, max_n);
+            if (n > 0) {
+                return n;
+            }
+            uint32_t key = not_empty_.PrepareWait();
+            if (filledSlots(head_.load(memory_order_relaxed), 1) > 0) {
+                not_empty_.CancelWait();
+                continue;
+            }
+            not_empty_.Wait(key);
+        }
+    }
+
+    size_t sz() {
+        return tail_.load(memory_order_acquire) - head_.load(memory_order_acquire);
+    }
+};
+
+void testOrdering() {
+    SpscRingBuffer<long> rb(1000);
+    const long n = 1000000;
+
+    thread producer([&rb, n]() {
+        for (long i = 0; i < n; i++) {
+            rb.Push(i);
+        }
+    });
+
+    for (long i = 0; i < n; i++) {
+        long v;
+        rb.WaitAndPop(v);
+        assert(v == i);
+    }
+    producer.join();
+    assert(rb.sz() == 0);
+    cout << "Ordering test passed" << endl;
+}
+
+void testBulk() {
+    SpscRingBuffer<long> rb(64);
+    const long n = 1000000;
+
+    thread producer([&rb, n]() {
+        vector<long> batch(37);
+        for (long i = 0; i < n; i += batch.size()) {
+            size_t cnt = min<long>(batch.size(), n - i);
+            for (size_t j = 0; j < cnt; j++) {
+                batch[j] = i + j;
+            }
+            rb.PushBulk(batch.data(), cnt);
+        }
+    });
+
+    vector<long> out(50);
+    long expected = 0;
+    while (expected < n) {
+        size_t got = rb.PopBulk(out.data(), out.size());
+        for (size_t j = 0; j < got; j++) {
+            assert(out[j] == expected);
+            expected++;
+        }
+    }
+    producer.join();
+
+    SpscRingBuffer<int> small(3);
+    int items[5] = {1, 2, 3, 4, 5};
+    // Capacity rounds up to 4.
+    size_t pushed = small.TryPushBulk(items, 5);
+    assert(pushed == 4);
+    bool pushed_when_full = small.TryPush(6);
+    assert(!pushed_when_full);
+    cout << "Bulk test passed" << endl;
+}
+
+// A full ring makes Push retry, the value has to survive the failed attempts.
+void testFullRingMoveOnly() {
+    SpscRingBuffer<unique_ptr<string> > rb(2);
+    const int n = 64;
+
+    unique_ptr<string> kept = make_unique<string>("kept");
+    bool pushed = rb.TryPush(make_unique<string>("a")) && rb.TryPush(make_unique<string>("b"));
+    assert(pushed);
+    // Full: a failed TryPush leaves the value where it was.
+    pushed = rb.TryPush(std::move(kept));
+    assert(!pushed && kept && *kept == "kept");
+    unique_ptr<string> v;
+    rb.WaitAndPop(v);
+    rb.WaitAndPop(v);
+    assert(*v == "b");
+
+    thread producer([&rb, n]() {
+        for (int i = 0; i < n; i++) {
+            rb.Push(make_unique<string>("payload-" + to_string(i)));
+        }
+    });
+
+    for (int i = 0; i < n; i++) {
+        if (i % 8 == 0) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+        rb.WaitAndPop(v);
+        assert(v && *v == "payload-" + to_string(i));
+    }
+    producer.join();
+    cout << "Full ring move-only test passed" << endl;
+}
+
+void bench(size_t batch) {
+    SpscRingBuffer<int> rb(4096);
+    const long n = 10000000;
+
+    auto start = std::chrono::steady_clock::now();
+    thread producer([&rb, n, batch]() {
+        vector<int> items(batch, 1);
+        for (long i = 0; i < n; i += batch) {
+            rb.PushBulk(items.data(), batch);
+        }
+    });
+
+    vector<int> out(batch);
+    long got = 0;
+    while (got < n) {
+        got += rb.PopBulk(out.data(), batch);
+    }
+    producer.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    cout << "batch " << batch << ": " << (n / secs / 1e6) << " M items/s" << endl;
+}
+
+int main() {
+    testOrdering();
+    testBulk();
+    testFullRingMoveOnly();
+    for (size_t batch : {1, 16, 256}) {
+        bench(batch);
+    }
+}
@@ -11,6 +11,9 @@
 #include <functional>
 #include <numeric>
 #include <set>
+#include <atomic>
+
+#include "SchedulerBench.h"
 
 using namespace std;
 
@@ -94,34 +97,19 @@ class Scheduler {
         while (!done_) {
             {
                 unique_lock<mutex> lk(mt_);
-                cnd_.wait(lk, [&](){ 
-                    // printTime(pq_.begin()->first);
-                    // printTime(cur_time());
-                    cout << (pq_.begin()->first <= cur_time()) << endl; 
-                    return (!pq_.empty() || done_); 
-                });
-
-                if (pq_.begin()->first <= cur_time()) {
-                    cout << "Found scheduler\n";
-                } else {
-                    cout << "Not found\n";
-                    continue;
-                }
+                cnd_.wait(lk, [&](){ return (!pq_.empty() || done_); });
 
-                cout << "done waiting"<< endl;
                 if (done_) {
                     break;
                 }
-                
-                cout << "Task available for schedule" << endl;
-                
-                // if (pq_.begin()->first <= std::chrono::system_clock::now()) {
-                    cout << "Test2" << endl; 
-                    // The task is available for pickup
-                    cur_task = *pq_.begin();
-                    cout << cur_task.second.delay << endl;
-                    pq_.erase(pq_.begin());
-                // }
+
+                if (pq_.begin()->first > cur_time()) {
+                    continue;
+                }
+
+                // The task is available for pickup
+                cur_task = *pq_.begin();
+                pq_.erase(pq_.begin());
 
                 if (cur_task.second.type == kFixedRate) {
                     auto new_start = cur_task.second.start_time +  std::chrono::nanoseconds(cur_task.second.delay);
@@ -186,6 +174,14 @@ class Scheduler {
 }        }
     }
 
+    void shutdown() {
+        {
+            lock_guard<mutex> lk(mt_);
+            done_ = true;
+        }
+        cnd_.notify_all();
+    }
+
     template<typename Callback>
     auto schedule(Callback&& func, long delay) {
         using ReturnType = decltype(func());
@@ -206,7 +202,6 @@ class Scheduler {
             lock_guard<mutex> lk(mt_);
             pq_.insert({start_time, task});
         }
-        cout << "done inserting task" << endl;
         cnd_.notify_one();
 
         return result;
@@ -291,6 +286,37 @@ void Test() {
     auto res2 = sch.scheduleWithFixedDelay(FixedDelayTask, delay, 3 * nano_sec);
 }
 
-int main() {
+// Periodic tasks reuse the promise of the first run and fail on the second set_value, so only
+// one-shot timers are measured.
+struct TaskSchedulerBench {
+    unique_ptr<Scheduler> sch_;
+
+    static const char* name() { return "TaskScheduler"; }
+
+    void start(int workers) { sch_ = make_unique<Scheduler>(workers); }
+
+    std::chrono::nanoseconds round(std::chrono::nanoseconds delay) {
+        return delay;
+    }
+
+    void arm(function<void()> job, std::chrono::nanoseconds delay) {
+        sch_->schedule(job, delay.count());
+    }
+
+    bool armPeriodic(function<void()>, std::chrono::nanoseconds, std::chrono::nanoseconds) {
+        return false;
+    }
+
+    void stop() {
+        sch_->shutdown();
+        sch_.reset();
+    }
+};
+
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        sched_bench::RunSuite<TaskSchedulerBench>(argc > 2 ? atoi(argv[2]) : 1000);
+        return 0;
+    }
     Test();
 }
\ No newline at end of file
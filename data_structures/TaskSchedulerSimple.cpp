@@ -11,6 +11,9 @@
 #include <functional>
 #include <numeric>
 #include <set>
+#include <atomic>
+
+#include "SchedulerBench.h"
 
 using namespace std;
 using Tp = std::chrono::time_point<std::chrono::system_clock>;
@@ -80,7 +83,7 @@ class TaskSchedulerSimple {
     }
 
     void timer_thread() {
-        while (true) {
+        while (!done_) {
             {
                 unique_lock<mutex> lk(mt_);
                 if (!tasks_.empty() && tasks_.begin()->start_time <= cur_time()) {
@@ -113,7 +116,7 @@ class TaskSchedulerSimple {
                     if (tasks_.begin()->start_time <= cur_time()) {
                         break;
                     }
-                    cnd_.wait_until(lk, tasks_.begin()->start_time, [&](){ return !tasks_.empty() && .begin()->start_time <= cur_time(); });
+                    cnd_.wait_until(lk, tasks_.begin()->start_time, [&](){ return !tasks_.empty() && tasks_.begin()->start_time <= cur_time(); });
                 }
 
                 auto res = *tasks_.begin();
@@ -160,6 +163,14 @@ class TaskSchedulerSimple {
         threads_.push_back(thread(&TaskSchedulerSimple::timer_thread, this));
     }
 
+    void shutdown() {
+        {
+            lock_guard<mutex> lk(mt_);
+            done_ = true;
+        }
+        cnd_.notify_all();
+    }
+
     void schedule(function<void()> task, long delay) {
         auto cur = cur_time();
         // convert(cur);
@@ -261,6 +272,44 @@ void Test() {
     // sch.scheduleWithFixedDelay(FixedDelayTask, delay, 5 * nano_sec);
 }
 
-int main() {
+// Delays are in whole seconds, so the benchmark rounds every delay and period up to a second.
+struct TaskSchedulerSimpleBench {
+    unique_ptr<TaskSchedulerSimple> sch_;
+
+    static const char* name() { return "TaskSchedulerSimple"; }
+
+    // One extra thread for the timer thread.
+    void start(int workers) { sch_ = make_unique<TaskSchedulerSimple>(workers + 1); }
+
+    std::chrono::nanoseconds round(std::chrono::nanoseconds delay) {
+        return std::chrono::seconds(seconds(delay));
+    }
+
+    void arm(function<void()> job, std::chrono::nanoseconds delay) {
+        sch_->schedule(job, seconds(delay));
+    }
+
+    bool armPeriodic(function<void()> job, std::chrono::nanoseconds delay, std::chrono::nanoseconds period) {
+        sch_->scheduleAtFixedRate(job, seconds(delay), seconds(period));
+        return true;
+    }
+
+    void stop() {
+        sch_->shutdown();
+        sch_.reset();
+    }
+
+    private:
+
+    long seconds(std::chrono::nanoseconds delay) {
+        return std::chrono::ceil<std::chrono::seconds>(delay).count();
+    }
+};
+
+int main(int argc, char** argv) {
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        sched_bench::RunSuite<TaskSchedulerSimpleBench>(argc > 2 ? atoi(argv[2]) : 1000);
+        return 0;
+    }
     Test();
 }
\ No newline at end of file
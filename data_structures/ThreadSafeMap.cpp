@@ -1,125 +1,382 @@
 #include <iostream>
-#include <stack>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
 #include <memory>
-#include <exception>
-#include <unordered_map>
-#include <list> 
-#include <shared_mutex>
+#include <vector>
+#include <atomic>
+#include <string>
+#include <optional>
+#include <functional>
+#include <random>
+#include <chrono>
+#include <cassert>
+
+#include "ThreadSafeMap.h"
 
 using namespace std;
 
-const int default_num_buckets = 99991;
+// Plugged in by the test. Ids that only differ above bit 32 all land in bucket 0 with it.
+struct IdentityHash {
+    size_t operator()(long key) const {
+        return key;
+    }
+};
 
-template <typename KEY, typename VALUE>
-class CoarseThreadSafeMap {
-    unordered_map<KEY, VALUE> mp_;
-    std::shared_mutex mp_mt_;
+void testThreadSafeMap() {
+    ThreadSafeMap<string, int> mp(100, 8);
+    assert(mp.buckets() == 128 && mp.stripes() == 8);
+    assert(!mp.get("a"));
+    bool deleted = mp.deleteKey("a");
+    assert(!deleted);
 
-    public:
+    mp.put("a", 1);
+    mp.put("b", 2);
+    mp.put("a", 3);
+    assert(*mp.get("a") == 3);
+    assert(*mp.get("b") == 2);
+    deleted = mp.deleteKey("a");
+    assert(deleted);
+    assert(!mp.get("a"));
 
-    shared_ptr<VALUE> get(KEY key) {
-        shared_ptr<VALUE> result;
-        shared_lock<std::shared_mutex> lk(mp_mt_);
-        if (mp_.find(key) != mp_.end()) {
-            result = make_shared<VALUE>(mp_[key]);
-        }
+    // More stripes than buckets is capped.
+    ThreadSafeMap<long, long, IdentityHash> small(4, 64);
+    assert(small.stripes() == 4);
+    for (long i = 0; i < 100; i++) {
+        small.put(i << 32, i);
+    }
+    for (long i = 0; i < 100; i++) {
+        assert(*small.get(i << 32) == i);
+    }
+    cout << "ThreadSafeMap test passed" << endl;
+}
 
-        return result;
+void testConcurrent() {
+    ThreadSafeMap<long, long> mp(1 << 12, 16);
+    const int threads = 8;
+    const long per_thread = 20000;
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&mp, t, per_thread]() {
+            for (long i = 0; i < per_thread; i++) {
+                long key = t * per_thread + i;
+                mp.put(key, key * 2);
+                assert(*mp.get(key) == key * 2);
+                if (i % 2) {
+                    bool deleted = mp.deleteKey(key);
+                    assert(deleted);
+                }
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
     }
 
-    void put(KEY key, VALUE value) {
-        lock_guard<std::shared_mutex> lk(mp_mt_);
-        mp_[key] = value;
+    for (long key = 0; key < threads * per_thread; key++) {
+        shared_ptr<long> val = mp.get(key);
+        assert(key % 2 ? !val : *val == key * 2);
     }
-};
+    cout << "Concurrent test passed" << endl;
+}
 
+// Counts copies, the accessors must not make any.
+struct Counted {
+    static atomic<int> copies;
+    long v;
 
-template<typename KEY, typename VALUE> 
-class Bucket {
-    list<pair<KEY, VALUE> > lst_;
-    shared_mutex lst_mt_;
+    explicit Counted(long x = 0) : v(x) {}
 
-    typedef typename list<pair<KEY, VALUE> >::iterator iterator;
-    // Function supposed to be called with lock held.
-    iterator getKey(KEY key) {
-        std::find_if(lst_.begin(), lst_.end(), [&](pair<KEY, VALUE> item) {
-            return item.first == key;
-        });
+    Counted(const Counted& other) : v(other.v) {
+        copies++;
     }
 
-    public:
+    Counted& operator=(const Counted& other) = default;
+};
 
-    Bucket() {}
+atomic<int> Counted::copies(0);
 
-    void addOrUpdate(KEY key, VALUE value) {
-        lock_guard<shared_mutex> lk(lst_mt_);
-        auto it = getKey(key);
-        if (it != end(lst_)) {
-            it->second = value;
-        } else {
-            lst_.push_back({key, value});
-        }
+void testAccessors() {
+    ThreadSafeMap<long, Counted> mp(16, 4);
+    mp.put(1, Counted(10));
+    Counted::copies = 0;
+
+    long seen = 0;
+    bool found = mp.visit(1, [&seen](const Counted& c) { seen = c.v; });
+    assert(found && seen == 10);
+    found = mp.visit(2, [](const Counted&) { assert(false); });
+    assert(!found);
+    {
+        ThreadSafeMap<long, Counted>::const_accessor acc;
+        found = mp.find(acc, 1);
+        assert(found && acc->v == 10);
+    }
+    assert(Counted::copies == 0);
+    {
+        ThreadSafeMap<long, Counted>::const_accessor acc;
+        found = mp.find(acc, 2);
+        assert(!found && acc.empty());
+        found = mp.find(acc, 1);
+        assert(found && acc->v == 10);
+        // A put links a new node, the accessor still reads the one it found.
+        mp.put(1, Counted(11));
+        assert((*acc).v == 10);
     }
+    Counted::copies = 0;
+    found = mp.visit(1, [&seen](const Counted& c) { seen = c.v; });
+    assert(found && seen == 11);
+    assert(Counted::copies == 0);
 
-    bool deleteKey(KEY key) {
-        lock_guard<shared_mutex> lk(lst_mt_);
-        bool found = false;
-        auto it = getKey(key);
+    CoarseThreadSafeMap<long, Counted> coarse;
+    coarse.put(1, Counted(20));
+    Counted::copies = 0;
+    found = coarse.visit(1, [&seen](const Counted& c) { seen = c.v; });
+    assert(found && seen == 20);
+    found = coarse.visit(2, [](const Counted&) {});
+    assert(!found);
+    {
+        CoarseThreadSafeMap<long, Counted>::const_accessor acc;
+        found = coarse.find(acc, 2);
+        assert(!found && acc.empty());
+        found = coarse.find(acc, 1);
+        assert(found && acc->v == 20);
+        // Reusing an accessor that holds the lock releases it before locking again.
+        found = coarse.find(acc, 1);
+        assert(found && acc->v == 20);
+        found = coarse.find(acc, 2);
+        assert(!found && acc.empty());
+        // The miss left acc unlocked, or this put would wait on it forever.
+        coarse.put(3, Counted(30));
+    }
+    assert(Counted::copies == 0);
+    assert(coarse.get(1)->v == 20 && coarse.get(3)->v == 30 && !coarse.get(2));
+    cout << "Accessors test passed" << endl;
+}
 
-        if (it != end(lst_)) {
-            lst_.erase(it);
-            found = true;
-        }
+void testCompute() {
+    ThreadSafeMap<string, long> mp(16, 4);
+    bool inserted = mp.try_emplace("a", 1);
+    assert(inserted);
+    inserted = mp.try_emplace("a", 2);
+    assert(!inserted);
+    assert(*mp.get("a") == 1);
 
-        return found;
-    }
+    bool called = false;
+    inserted = mp.compute_if_absent("a", [&called]() { called = true; return 3L; });
+    assert(!inserted && !called);
+    inserted = mp.compute_if_absent("b", []() { return 3L; });
+    assert(inserted);
+    assert(*mp.get("b") == 3);
 
-    shared_ptr<VALUE> getValue(KEY key) {
-        shared_lock<shared_mutex> lk(lst_mt_);
-        auto it = getKey(key);
-        shared_ptr<VALUE> result;
-        if (it != end(lst_)) {
-            result = make_shared<VALUE> (it->second);
-        }
+    mp.compute("a", [](const long* v) { return optional<long>(v ? *v + 10 : 0); });
+    assert(*mp.get("a") == 11);
+    // nullopt removes the key, or leaves an absent one absent.
+    mp.compute("b", [](const long*) { return optional<long>(); });
+    mp.compute("c", [](const long* v) { assert(!v); return optional<long>(); });
+    assert(!mp.get("b") && !mp.get("c"));
+    assert(mp.size() == 1);
+
+    mp.merge("c", 5, plus<long>());
+    mp.merge("c", 5, plus<long>());
+    assert(*mp.get("c") == 10);
+    assert(mp.size() == 2);
 
-        return result;
+    // Counters bumped from many threads, while the table grows under them: no update is lost.
+    ThreadSafeMap<long, long> counters(4, 4);
+    const int threads = 8;
+    const long per_thread = 20000;
+    const long keys = 1000;
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.push_back(thread([&counters, per_thread, keys]() {
+            for (long i = 0; i < per_thread; i++) {
+                counters.merge(i % keys, 1, plus<long>());
+            }
+        }));
     }
-};
+    for (auto& w : workers) {
+        w.join();
+    }
+    assert((long)counters.size() == keys);
+    for (long key = 0; key < keys; key++) {
+        assert(*counters.get(key) == threads * per_thread / keys);
+    }
+    cout << "Compute test passed" << endl;
+}
 
-template<typename KEY, typename VALUE>
-class ThreadSafeMap {
-    int n_buckets_;
-    vector<unique_ptr<Bucket<KEY, VALUE> > > buckets_;
-    private:
+void testBatch() {
+    ThreadSafeMap<long, long> mp(16, 4);
+    vector<pair<long, long> > items;
+    for (long key = 0; key < 1000; key++) {
+        items.push_back({key, key * 2});
+    }
+    // Given twice, the later pair wins.
+    items.push_back({7, -7});
+    mp.multi_put(items);
+    assert(mp.size() == 1000);
+    // One batch is one growth check, the migration it starts is finished by later writes.
+    assert(mp.resizing());
 
-    size_t getIndex(KEY key) {
-        return (hash<KEY> {} (key)) % n_buckets_;
+    vector<long> keys;
+    for (long key = -10; key < 1010; key++) {
+        keys.push_back(key);
     }
+    vector<shared_ptr<long> > vals = mp.multi_get(keys);
+    assert(vals.size() == keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        long key = keys[i];
+        if (key < 0 || key >= 1000) {
+            assert(!vals[i]);
+        } else {
+            assert(*vals[i] == (key == 7 ? -7 : key * 2));
+        }
+    }
+    assert(mp.multi_get({}).empty());
+    mp.multi_put({});
+    cout << "Batch test passed" << endl;
+}
+
+// Start tiny and let writers grow the table while readers check every key written so far.
+void testGrowth() {
+    ThreadSafeMap<long, long> mp(4, 4);
+    const int writers = 4;
+    const long per_writer = 50000;
+    atomic<long> written(0);
+    atomic<bool> done(false);
 
-    public:
-    
-    ThreadSafeMap(int n_buckets = default_num_buckets) : n_buckets_(n_buckets) {
-        for (int i = 0; i < n_buckets_; i++) {
-            buckets_.push_back(make_unique<Bucket<KEY, VALUE> >());
+    vector<thread> threads;
+    for (int t = 0; t < writers; t++) {
+        threads.push_back(thread([&mp, &written, t, per_writer]() {
+            for (long i = 0; i < per_writer; i++) {
+                long key = i * writers + t;
+                mp.put(key, -key);
+                written++;
+            }
+        }));
+    }
+    threads.push_back(thread([&mp, &done]() {
+        long key = 0;
+        while (!done) {
+            // Not written yet, or written with its value, whichever table it sits in.
+            shared_ptr<long> val = mp.get(key);
+            assert(!val || *val == -key);
+            key = (key + 7919) % 100000;
         }
+    }));
+    for (int t = 0; t < writers; t++) {
+        threads[t].join();
     }
+    done = true;
+    threads.back().join();
 
-    void put(KEY key, VALUE value) {
-        buckets_[getIndex(key)]->addOrUpdate(key, value);
+    long n = writers * per_writer;
+    assert(written == n);
+    assert((long)mp.size() == n);
+    for (long key = 0; key < n; key++) {
+        assert(*mp.get(key) == -key);
+    }
+    // Writes drive the last migration to its end, 100000 deletes move far more than enough buckets.
+    for (long key = 0; key < n; key += 2) {
+        bool deleted = mp.deleteKey(key);
+        assert(deleted);
+    }
+    assert(!mp.resizing());
+    assert(mp.buckets() >= 65536);
+    assert((long)mp.size() == n / 2);
+    for (long key = 0; key < n; key++) {
+        shared_ptr<long> val = mp.get(key);
+        assert(key % 2 == 0 ? !val : *val == -key);
     }
+    cout << "Growth test passed, " << mp.buckets() << " buckets" << endl;
+}
 
-    shared_ptr<VALUE> get(KEY key, VALUE value) {
-        return buckets_[getIndex(key)]->getValue(key);
+// Lock free gets against writers that keep replacing and deleting the nodes being read. The value
+// is always a multiple of the key, a node freed under a reader would show up as garbage (or in asan).
+void testReadersDuringWrites() {
+    ThreadSafeMap<long, long> mp(64, 8);
+    const long keys = 256;
+    for (long key = 1; key <= keys; key++) {
+        mp.put(key, key);
     }
-    
-    bool deleteKey(KEY key) {
-        return buckets_[getIndex(key)]->deleteKey(key);
+    atomic<bool> done(false);
+    vector<thread> threads;
+    for (int t = 0; t < 2; t++) {
+        threads.push_back(thread([&mp, &done, keys, t]() {
+            for (long round = 1; round <= 2000; round++) {
+                for (long key = 1 + t; key <= keys; key += 2) {
+                    if (round % 7 == 0) {
+                        mp.deleteKey(key);
+                    } else {
+                        mp.put(key, key * round);
+                    }
+                }
+            }
+            done = true;
+        }));
     }
-};
+    long reads = 0;
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(thread([&mp, &done, keys]() {
+            while (!done) {
+                for (long key = 1; key <= keys; key++) {
+                    shared_ptr<long> val = mp.get(key);
+                    assert(!val || *val % key == 0);
+                }
+            }
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (long key = 1; key <= keys; key++) {
+        reads += mp.get(key) != nullptr;
+    }
+    assert(reads == keys);
+    cout << "Readers during writes test passed" << endl;
+}
 
-int main() {
+// Random keys out of a table much bigger than the caches, one get at a time and in batches.
+void benchBatch() {
+    const long n = 1 << 20;
+    const size_t batch = 128;
+    const long batches = 20000;
+    ThreadSafeMap<long, long> mp(n);
+    for (long i = 0; i < n; i++) {
+        mp.put(i, i);
+    }
+
+    minstd_rand rng(1);
+    vector<long> keys(batch);
+    long found = 0;
+    double single_secs = 0;
+    double batch_secs = 0;
+    for (long b = 0; b < batches; b++) {
+        for (size_t i = 0; i < batch; i++) {
+            keys[i] = rng() % (2 * n);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (long key : keys) {
+            found += mp.get(key) != nullptr;
+        }
+        auto mid = std::chrono::steady_clock::now();
+        for (auto& val : mp.multi_get(keys)) {
+            found -= val != nullptr;
+        }
+        auto end = std::chrono::steady_clock::now();
+        single_secs += std::chrono::duration<double>(mid - start).count();
+        batch_secs += std::chrono::duration<double>(end - mid).count();
+    }
+    assert(found == 0);
+    double lookups = double(batch) * batches;
+    cout << "get: " << (single_secs / lookups * 1e9) << " ns/key, multi_get (" << batch << " keys): "
+         << (batch_secs / lookups * 1e9) << " ns/key" << endl;
+}
 
-}
\ No newline at end of file
+int main() {
+    testThreadSafeMap();
+    testAccessors();
+    testCompute();
+    testBatch();
+    testConcurrent();
+    testGrowth();
+    testReadersDuringWrites();
+    benchBatch();
+}
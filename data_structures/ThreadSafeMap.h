@@ -0,0 +1,707 @@
+#pragma once
+
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <exception>
+#include <unordered_map>
+#include <list>
+#include <shared_mutex>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <cstdint>
+
+#include "EpochReclaim.h"
+
+using namespace std;
+
+const int default_num_buckets = 1024;
+const int default_num_stripes = 64;
+
+template <typename KEY, typename VALUE>
+class CoarseThreadSafeMap {
+    unordered_map<KEY, VALUE> mp_;
+    std::shared_mutex mp_mt_;
+
+    public:
+
+    // Read handle on a value in place. Holds the map's shared lock while it is alive, so keep it
+    // short: every writer waits for it.
+    class const_accessor {
+        shared_lock<std::shared_mutex> lk_;
+        const VALUE* value_;
+
+        friend class CoarseThreadSafeMap;
+
+        public:
+
+        const_accessor() : value_(nullptr) {}
+
+        bool empty() const {
+            return value_ == nullptr;
+        }
+
+        const VALUE& operator*() const {
+            return *value_;
+        }
+
+        const VALUE* operator->() const {
+            return value_;
+        }
+    };
+
+    shared_ptr<VALUE> get(KEY key) {
+        shared_lock<std::shared_mutex> lk(mp_mt_);
+        auto it = mp_.find(key);
+        return it == mp_.end() ? shared_ptr<VALUE>() : make_shared<VALUE>(it->second);
+    }
+
+    // Calls fn(const VALUE&) on the value of key under the shared lock. Returns false if absent.
+    template <typename Fn>
+    bool visit(const KEY& key, Fn fn) {
+        shared_lock<std::shared_mutex> lk(mp_mt_);
+        auto it = mp_.find(key);
+        if (it == mp_.end()) {
+            return false;
+        }
+        fn(static_cast<const VALUE&>(it->second));
+        return true;
+    }
+
+    // Points acc at the value of key. Returns false, with acc empty and unlocked, if absent.
+    bool find(const_accessor& acc, const KEY& key) {
+        // A reused accessor may still hold the shared lock, taking it a second time is undefined.
+        acc.value_ = nullptr;
+        if (acc.lk_.owns_lock()) {
+            acc.lk_.unlock();
+        }
+        acc.lk_ = shared_lock<std::shared_mutex>(mp_mt_);
+        auto it = mp_.find(key);
+        if (it == mp_.end()) {
+            acc.lk_.unlock();
+            return false;
+        }
+        acc.value_ = &it->second;
+        return true;
+    }
+
+    void put(KEY key, VALUE value) {
+        lock_guard<std::shared_mutex> lk(mp_mt_);
+        mp_[key] = value;
+    }
+};
+
+/*
+std::hash of an integer is the integer itself. With a power of two table the index is the low bits
+of the hash, so keys that differ only in their high bits (ids with a shard prefix, pointers, ...)
+would all land in one bucket. FastHash runs the hash through the murmur3 finalizer, so every bit of
+the hash ends up in the low bits. Any hasher with the same operator() can be plugged in instead.
+*/
+template <typename KEY>
+struct FastHash {
+    size_t operator()(const KEY& key) const {
+        uint64_t h = hash<KEY> {} (key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+/*
+A chain of entries that readers walk without a lock.
+
+Nodes are immutable once linked: an update links a new node in place of the old one, a delete
+unlinks the node, and in both cases the old node goes to epoch::retire. The unlinked node still
+points at the rest of the chain, so a reader standing on it carries on as if the change happened
+after it passed.
+
+Writers have to hold the lock of the bucket's stripe, readers an EpochGuard.
+*/
+template<typename KEY, typename VALUE>
+class Bucket {
+    struct Node {
+        const KEY key;
+        const VALUE value;
+        atomic<Node*> next;
+
+        Node(KEY k, VALUE v, Node* n) : key(std::move(k)), value(std::move(v)), next(n) {}
+    };
+
+    atomic<Node*> head_;
+
+    // Call holding the stripe lock. Returns the link that points at key's node, or nullptr.
+    atomic<Node*>* getKey(const KEY& key) {
+        atomic<Node*>* link = &head_;
+        for (Node* node = link->load(memory_order_relaxed); node; node = link->load(memory_order_relaxed)) {
+            if (node->key == key) {
+                return link;
+            }
+            link = &node->next;
+        }
+        return nullptr;
+    }
+
+    // Call holding an EpochGuard.
+    Node* find(const KEY& key) {
+        for (Node* node = head_.load(memory_order_acquire); node; node = node->next.load(memory_order_acquire)) {
+            if (node->key == key) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    public:
+
+    Bucket() : head_(nullptr) {}
+
+    Bucket(const Bucket& other) = delete;
+    Bucket& operator=(const Bucket& other) = delete;
+
+    ~Bucket() {
+        Node* node = head_.load(memory_order_relaxed);
+        while (node) {
+            Node* next = node->next.load(memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+
+    // Returns true if key was not in the bucket yet.
+    bool addOrUpdate(KEY key, VALUE value) {
+        atomic<Node*>* link = getKey(key);
+        if (link) {
+            Node* old = link->load(memory_order_relaxed);
+            link->store(new Node(std::move(key), std::move(value), old->next.load(memory_order_relaxed)),
+                        memory_order_release);
+            epoch::retire(old);
+            return false;
+        }
+        insertNew(std::move(key), std::move(value));
+        return true;
+    }
+
+    bool contains(const KEY& key) {
+        return getKey(key) != nullptr;
+    }
+
+    // key must not be in the bucket yet.
+    void insertNew(KEY key, VALUE value) {
+        head_.store(new Node(std::move(key), std::move(value), head_.load(memory_order_relaxed)), memory_order_release);
+    }
+
+    // fn(const VALUE* current), current is nullptr if key is absent, returns the new value or nullopt
+    // to remove key (or leave it absent). Returns 1 if key was added, -1 if removed, 0 otherwise.
+    template <typename Fn>
+    int compute(KEY key, Fn& fn) {
+        atomic<Node*>* link = getKey(key);
+        Node* old = link ? link->load(memory_order_relaxed) : nullptr;
+        optional<VALUE> value = fn(old ? &old->value : nullptr);
+        if (!old) {
+            if (!value) {
+                return 0;
+            }
+            insertNew(std::move(key), std::move(*value));
+            return 1;
+        }
+        Node* next = old->next.load(memory_order_relaxed);
+        link->store(value ? new Node(std::move(key), std::move(*value), next) : next, memory_order_release);
+        epoch::retire(old);
+        return value ? 0 : -1;
+    }
+
+    bool deleteKey(KEY key) {
+        atomic<Node*>* link = getKey(key);
+        if (!link) {
+            return false;
+        }
+        Node* old = link->load(memory_order_relaxed);
+        link->store(old->next.load(memory_order_relaxed), memory_order_release);
+        epoch::retire(old);
+        return true;
+    }
+
+    // Call holding an EpochGuard.
+    shared_ptr<VALUE> getValue(const KEY& key) {
+        Node* node = find(key);
+        return node ? make_shared<VALUE>(node->value) : shared_ptr<VALUE>();
+    }
+
+    // Call holding an EpochGuard. The value stays valid as long as the guard.
+    const VALUE* findValue(const KEY& key) {
+        Node* node = find(key);
+        return node ? &node->value : nullptr;
+    }
+
+    bool empty() {
+        return head_.load(memory_order_relaxed) == nullptr;
+    }
+
+    // Copies the entries for which goes_high(key) holds to high and the others to low. The chain
+    // itself is left alone for readers that are still on it.
+    template <typename Pred>
+    void copyInto(Bucket& low, Bucket& high, Pred goes_high) {
+        for (Node* node = head_.load(memory_order_relaxed); node; node = node->next.load(memory_order_relaxed)) {
+            Bucket& to = goes_high(node->key) ? high : low;
+            to.head_.store(new Node(node->key, node->value, to.head_.load(memory_order_relaxed)), memory_order_relaxed);
+        }
+    }
+};
+
+/*
+Striped hash map.
+
+1. The number of locks is independent of the number of buckets: bucket i is guarded by stripe
+   i & (n_stripes - 1). A few dozen stripes are enough to keep threads apart, where a lock per
+   bucket cost a shared_mutex (56 bytes) for each of the 99991 buckets.
+2. Buckets are allocated on the first insert into them. An empty map is one pointer per bucket plus
+   the stripes, and a lookup in a bucket that was never written to does not touch any bucket.
+3. Bucket and stripe counts are powers of two, the index is hash & mask instead of a modulo by a
+   prime. HASH is a template parameter, FastHash by default so that the low bits are well mixed.
+4. The table doubles once there are more entries than buckets, without a stop the world rehash:
+   - The thread that sees the map over its load allocates the new table and links it from the old
+     one. From then on every put / deleteKey first moves a couple of old buckets over (split into
+     bucket i and i + old size of the new table), so the work is spread over the writers.
+   - The stripe is picked by the low bits of the hash, and there are never more stripes than
+     buckets. So an old bucket and the two new buckets it splits into share a stripe: moving one
+     bucket takes one stripe lock, and any operation on a key holds the only lock that matters.
+   - A moved old bucket is replaced by a marker, an operation that finds the marker continues in
+     the new table. The old chain is copied, not relinked, so a reader still walking it is fine.
+   - When the last bucket has moved the new table becomes the current one. The old pointer array
+     is kept until the map is destroyed, a thread may still be looking at it, and all the old
+     arrays together are smaller than the current one.
+5. get takes no lock at all. It walks the bucket under an EpochGuard, and everything writers unlink
+   (replaced or deleted nodes, buckets that were migrated) goes through epoch::retire. A read is a
+   few loads and a store to the thread's own epoch record, nothing that other cores also write.
+   Writers still serialize on the stripe lock, which is a plain mutex now that readers skip it.
+6. get copies the value into a new shared_ptr. visit and const_accessor read it in place instead:
+   nodes are immutable and only freed once no guard can see them, so a reference into a node is
+   safe for as long as the guard lives. A put meanwhile links a new node, the reader keeps seeing
+   the value as it was when it looked.
+7. Read-modify-write goes through compute and the helpers built on it (try_emplace,
+   compute_if_absent, merge): one hash, one stripe lock and one walk of the chain, where get then
+   put hashes twice, locks twice and loses updates to a writer in between. The callback runs under
+   the stripe lock, so it must not call back into the map.
+8. multi_get / multi_put take a batch of keys. All hashes are computed up front, which lets the
+   loop prefetch the bucket slot kPrefetchDistance keys ahead and the bucket itself half that far
+   ahead, so the cache misses of several keys overlap instead of coming one after the other.
+   multi_put also sorts the batch by stripe (stable, a key given twice keeps its last value) and
+   takes each stripe lock once per batch instead of once per key.
+*/
+template<typename KEY, typename VALUE, typename HASH = FastHash<KEY> >
+class ThreadSafeMap {
+    typedef Bucket<KEY, VALUE> BucketType;
+
+    struct alignas(64) Stripe {
+        mutex mt;
+    };
+
+    struct Table {
+        size_t mask;
+        unique_ptr<atomic<BucketType*>[]> buckets;
+        // Set while this table is being migrated into the next one.
+        atomic<Table*> next;
+        atomic<size_t> migrate_next;
+        atomic<size_t> migrated;
+
+        explicit Table(size_t n_buckets) :
+        mask(n_buckets - 1),
+        buckets(new atomic<BucketType*>[n_buckets]),
+        next(nullptr),
+        migrate_next(0),
+        migrated(0) {
+            for (size_t i = 0; i <= mask; i++) {
+                buckets[i].store(nullptr, memory_order_relaxed);
+            }
+        }
+
+        ~Table() {
+            for (size_t i = 0; i <= mask; i++) {
+                BucketType* bucket = buckets[i].load(memory_order_relaxed);
+                if (bucket != moved()) {
+                    delete bucket;
+                }
+            }
+        }
+    };
+
+    // Buckets moved per write while a migration runs.
+    static constexpr size_t kMigrateBatch = 2;
+    // How many keys ahead the batch operations prefetch.
+    static constexpr size_t kPrefetchDistance = 8;
+
+    size_t stripe_mask_;
+    unique_ptr<Stripe[]> stripes_;
+    HASH hasher_;
+    atomic<Table*> table_;
+    atomic<Table*> migrating_;
+    atomic<bool> resizing_;
+    atomic<long> size_;
+    vector<unique_ptr<Table> > retired_;
+
+    static BucketType* moved() {
+        return reinterpret_cast<BucketType*>(uintptr_t(1));
+    }
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 1;
+        while (cap < n) {
+            cap <<= 1;
+        }
+        return cap;
+    }
+
+    mutex& stripeFor(size_t h) {
+        return stripes_[h & stripe_mask_].mt;
+    }
+
+    // Call holding the stripe lock of h or an EpochGuard. Returns the bucket h belongs in,
+    // following the marker of a moved bucket into the new table. With create, a missing bucket is
+    // allocated, which needs the stripe lock. Otherwise returns nullptr if the bucket was never
+    // written to.
+    BucketType* findBucket(size_t h, bool create = false) {
+        Table* table = table_.load(memory_order_acquire);
+        BucketType* bucket = table->buckets[h & table->mask].load(memory_order_acquire);
+        while (bucket == moved()) {
+            table = table->next.load(memory_order_acquire);
+            bucket = table->buckets[h & table->mask].load(memory_order_acquire);
+        }
+        if (!bucket && create) {
+            bucket = new BucketType();
+            table->buckets[h & table->mask].store(bucket, memory_order_release);
+        }
+        return bucket;
+    }
+
+    // First step of the prefetch pipeline: the slot in the bucket array.
+    void prefetchSlot(size_t h) {
+        Table* table = table_.load(memory_order_acquire);
+        __builtin_prefetch(&table->buckets[h & table->mask]);
+    }
+
+    // Second step, once the slot is (hopefully) cached: the bucket it points at.
+    void prefetchBucket(size_t h) {
+        Table* table = table_.load(memory_order_acquire);
+        BucketType* bucket = table->buckets[h & table->mask].load(memory_order_relaxed);
+        if (bucket && bucket != moved()) {
+            __builtin_prefetch(bucket);
+        }
+    }
+
+    void maybeGrow() {
+        Table* table = table_.load(memory_order_acquire);
+        if (size_.load(memory_order_relaxed) <= (long)table->mask + 1) {
+            return;
+        }
+        bool expected = false;
+        if (!resizing_.compare_exchange_strong(expected, true)) {
+            return;
+        }
+        // Another resize may have finished between the check and the CAS, and already made room.
+        table = table_.load(memory_order_acquire);
+        if (size_.load(memory_order_relaxed) <= (long)table->mask + 1) {
+            resizing_.store(false);
+            return;
+        }
+        table->next.store(new Table(2 * (table->mask + 1)), memory_order_release);
+        migrating_.store(table, memory_order_release);
+    }
+
+    // Moves old bucket i into the next table.
+    void migrateBucket(Table* old, size_t i) {
+        Table* next = old->next.load(memory_order_acquire);
+        lock_guard<mutex> lk(stripeFor(i));
+        BucketType* bucket = old->buckets[i].load(memory_order_relaxed);
+        if (bucket && !bucket->empty()) {
+            BucketType* low = new BucketType();
+            BucketType* high = new BucketType();
+            size_t high_bit = old->mask + 1;
+            bucket->copyInto(*low, *high, [this, high_bit](const KEY& key) { return hasher_(key) & high_bit; });
+            for (auto& part : {make_pair(i, low), make_pair(i + high_bit, high)}) {
+                if (part.second->empty()) {
+                    delete part.second;
+                } else {
+                    next->buckets[part.first].store(part.second, memory_order_release);
+                }
+            }
+        }
+        old->buckets[i].store(moved(), memory_order_release);
+        if (bucket) {
+            epoch::retire(bucket);
+        }
+    }
+
+    // Called by writers before they take their own stripe lock.
+    void helpMigrate() {
+        Table* old = migrating_.load(memory_order_acquire);
+        if (!old) {
+            return;
+        }
+        for (size_t n = 0; n < kMigrateBatch; n++) {
+            size_t i = old->migrate_next.fetch_add(1);
+            if (i > old->mask) {
+                return;
+            }
+            migrateBucket(old, i);
+            if (old->migrated.fetch_add(1) == old->mask) {
+                // Last one: the next table takes over. Only this thread gets here, and no other
+                // resize can start until resizing_ is cleared.
+                table_.store(old->next.load(memory_order_relaxed), memory_order_release);
+                migrating_.store(nullptr, memory_order_release);
+                retired_.push_back(unique_ptr<Table>(old));
+                resizing_.store(false);
+                return;
+            }
+        }
+    }
+
+    public:
+
+    // Read handle on a value in place, no copy and no allocation. Holds an EpochGuard, so it
+    // belongs to the thread that made it, and one kept around holds back reclamation for the whole
+    // process.
+    class const_accessor {
+        EpochGuard guard_;
+        const VALUE* value_;
+
+        friend class ThreadSafeMap;
+
+        public:
+
+        const_accessor() : value_(nullptr) {}
+
+        bool empty() const {
+            return value_ == nullptr;
+        }
+
+        const VALUE& operator*() const {
+            return *value_;
+        }
+
+        const VALUE* operator->() const {
+            return value_;
+        }
+    };
+
+    ThreadSafeMap(size_t n_buckets = default_num_buckets, size_t n_stripes = default_num_stripes, HASH hasher = HASH()) :
+    hasher_(hasher),
+    table_(new Table(roundUp(max<size_t>(n_buckets, 1)))),
+    migrating_(nullptr),
+    resizing_(false),
+    size_(0) {
+        stripe_mask_ = min(roundUp(max<size_t>(n_stripes, 1)), table_.load()->mask + 1) - 1;
+        stripes_.reset(new Stripe[stripe_mask_ + 1]);
+    }
+
+    ThreadSafeMap(const ThreadSafeMap& other) = delete;
+    ThreadSafeMap& operator=(const ThreadSafeMap& other) = delete;
+
+    ~ThreadSafeMap() {
+        Table* table = table_.load();
+        delete table->next.load();
+        delete table;
+    }
+
+    void put(KEY key, VALUE value) {
+        helpMigrate();
+        size_t h = hasher_(key);
+        {
+            lock_guard<mutex> lk(stripeFor(h));
+            if (!findBucket(h, true)->addOrUpdate(std::move(key), std::move(value))) {
+                return;
+            }
+            size_.fetch_add(1, memory_order_relaxed);
+        }
+        maybeGrow();
+    }
+
+    shared_ptr<VALUE> get(KEY key) {
+        size_t h = hasher_(key);
+        EpochGuard guard;
+        BucketType* bucket = findBucket(h);
+        return bucket ? bucket->getValue(key) : shared_ptr<VALUE>();
+    }
+
+    // Calls fn(const VALUE&) on the value of key in place. Returns false if absent.
+    template <typename Fn>
+    bool visit(const KEY& key, Fn fn) {
+        size_t h = hasher_(key);
+        EpochGuard guard;
+        BucketType* bucket = findBucket(h);
+        const VALUE* value = bucket ? bucket->findValue(key) : nullptr;
+        if (!value) {
+            return false;
+        }
+        fn(*value);
+        return true;
+    }
+
+    // Points acc at the value of key. Returns false, with acc empty, if absent.
+    bool find(const_accessor& acc, const KEY& key) {
+        BucketType* bucket = findBucket(hasher_(key));
+        acc.value_ = bucket ? bucket->findValue(key) : nullptr;
+        return acc.value_ != nullptr;
+    }
+
+    // Sets key to fn(current), current being nullptr if key is absent. fn returns optional<VALUE>,
+    // nullopt removes key.
+    template <typename Fn>
+    void compute(KEY key, Fn fn) {
+        helpMigrate();
+        size_t h = hasher_(key);
+        int change = 0;
+        {
+            lock_guard<mutex> lk(stripeFor(h));
+            BucketType* bucket = findBucket(h);
+            if (bucket) {
+                change = bucket->compute(std::move(key), fn);
+            } else {
+                // Only allocate the bucket if fn actually inserts something.
+                optional<VALUE> value = fn(static_cast<const VALUE*>(nullptr));
+                if (value) {
+                    findBucket(h, true)->insertNew(std::move(key), std::move(*value));
+                    change = 1;
+                }
+            }
+            if (change) {
+                size_.fetch_add(change, memory_order_relaxed);
+            }
+        }
+        if (change > 0) {
+            maybeGrow();
+        }
+    }
+
+    // Inserts VALUE(args...) if key is absent, the value is only built then. Returns true if inserted.
+    template <typename... Args>
+    bool try_emplace(KEY key, Args&&... args) {
+        return compute_if_absent(std::move(key), [&args...]() { return VALUE(std::forward<Args>(args)...); });
+    }
+
+    // Inserts fn() if key is absent, fn is only called then. Returns true if inserted.
+    template <typename Fn>
+    bool compute_if_absent(KEY key, Fn fn) {
+        helpMigrate();
+        size_t h = hasher_(key);
+        {
+            lock_guard<mutex> lk(stripeFor(h));
+            BucketType* bucket = findBucket(h);
+            if (bucket && bucket->contains(key)) {
+                return false;
+            }
+            VALUE value = fn();
+            findBucket(h, true)->insertNew(std::move(key), std::move(value));
+            size_.fetch_add(1, memory_order_relaxed);
+        }
+        maybeGrow();
+        return true;
+    }
+
+    // Sets key to fn(current, delta), or to delta if key is absent. merge(key, 1, plus<long>()) is
+    // a counter.
+    template <typename Fn>
+    void merge(KEY key, VALUE delta, Fn fn) {
+        compute(std::move(key), [&delta, &fn](const VALUE* current) {
+            return optional<VALUE>(current ? fn(*current, delta) : std::move(delta));
+        });
+    }
+
+    // get for every key of the batch, results in the same order.
+    vector<shared_ptr<VALUE> > multi_get(const vector<KEY>& keys) {
+        size_t n = keys.size();
+        vector<size_t> hashes(n);
+        for (size_t i = 0; i < n; i++) {
+            hashes[i] = hasher_(keys[i]);
+        }
+        vector<shared_ptr<VALUE> > result(n);
+        EpochGuard guard;
+        for (size_t i = 0; i < min(n, kPrefetchDistance); i++) {
+            prefetchSlot(hashes[i]);
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (i + kPrefetchDistance < n) {
+                prefetchSlot(hashes[i + kPrefetchDistance]);
+            }
+            if (i + kPrefetchDistance / 2 < n) {
+                prefetchBucket(hashes[i + kPrefetchDistance / 2]);
+            }
+            BucketType* bucket = findBucket(hashes[i]);
+            if (bucket) {
+                result[i] = bucket->getValue(keys[i]);
+            }
+        }
+        return result;
+    }
+
+    // put for every pair of the batch. A key given more than once ends up with its last value.
+    void multi_put(vector<pair<KEY, VALUE> > items) {
+        size_t n = items.size();
+        vector<size_t> hashes(n);
+        vector<size_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            hashes[i] = hasher_(items[i].first);
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [this, &hashes](size_t a, size_t b) {
+            return (hashes[a] & stripe_mask_) < (hashes[b] & stripe_mask_);
+        });
+
+        bool inserted = false;
+        size_t i = 0;
+        while (i < n) {
+            helpMigrate();
+            size_t stripe = hashes[order[i]] & stripe_mask_;
+            lock_guard<mutex> lk(stripes_[stripe].mt);
+            long added = 0;
+            for (; i < n && (hashes[order[i]] & stripe_mask_) == stripe; i++) {
+                if (i + kPrefetchDistance < n) {
+                    prefetchSlot(hashes[order[i + kPrefetchDistance]]);
+                }
+                pair<KEY, VALUE>& item = items[order[i]];
+                added += findBucket(hashes[order[i]], true)->addOrUpdate(std::move(item.first), std::move(item.second));
+            }
+            if (added) {
+                size_.fetch_add(added, memory_order_relaxed);
+                inserted = true;
+            }
+        }
+        if (inserted) {
+            maybeGrow();
+        }
+    }
+
+    bool deleteKey(KEY key) {
+        helpMigrate();
+        size_t h = hasher_(key);
+        lock_guard<mutex> lk(stripeFor(h));
+        BucketType* bucket = findBucket(h);
+        if (!bucket || !bucket->deleteKey(key)) {
+            return false;
+        }
+        size_.fetch_sub(1, memory_order_relaxed);
+        return true;
+    }
+
+    size_t size() {
+        return size_.load(memory_order_relaxed);
+    }
+
+    size_t buckets() {
+        return table_.load(memory_order_acquire)->mask + 1;
+    }
+
+    size_t stripes() {
+        return stripe_mask_ + 1;
+    }
+
+    bool resizing() {
+        return migrating_.load(memory_order_acquire) != nullptr;
+    }
+};
@@ -5,29 +5,118 @@
 #include <condition_variable>
 #include <memory>
 #include <exception>
+#include <queue>
+#include <vector>
+#include <chrono>
+#include <optional>
+#include <type_traits>
+#include <string>
+#include <iterator>
+#include <stdexcept>
+#include <cassert>
+
+#include "EventCount.h"
 
 using namespace std;
 
+/*
+Elements are wrapped in a shared_ptr before they enter the queue so that popping them can not throw
+after the queue has been modified (C++ Concurrency in Action, 4.2). That costs an allocation and
+atomic refcounting per element even for an int.
+
+If T is nothrow move constructible, moving it out of the queue can not throw either, so the queue
+stores T directly and additionally offers pops that return optional<T> / move into a T&. The
+shared_ptr pops stay available: they allocate before popping, so a bad_alloc leaves the queue as it
+was.
+
+Consumers park on an EventCount instead of a condition variable. A Push with nobody waiting only
+costs a fence and a load on top of the lock, no notify call.
+*/
 template <typename T>
 class ThreadSafeQueue {
-    queue<shared_ptr<T> > q_;
+    static constexpr bool kStoreByValue = is_nothrow_move_constructible<T>::value;
+    using Stored = typename conditional<kStoreByValue, T, shared_ptr<T> >::type;
+
+    template <typename U>
+    using IfByValue = typename enable_if<is_nothrow_move_constructible<U>::value, int>::type;
+
+    queue<Stored> q_;
     mutex q_mt_;
-    condition_variable q_cnd_;
+    EventCount not_empty_;
+
+    static Stored wrap(T val) {
+        if constexpr (kStoreByValue) {
+            return val;
+        } else {
+            return make_shared<T> (std::move(val));
+        }
+    }
+
+    // Call holding the lock with the queue non empty.
+    shared_ptr<T> popShared() {
+        shared_ptr<T> val_ptr;
+        if constexpr (kStoreByValue) {
+            val_ptr = make_shared<T> (std::move(q_.front()));
+        } else {
+            val_ptr = q_.front();
+        }
+        q_.pop();
+        return val_ptr;
+    }
+
+    // Call holding the lock with the queue non empty. Writes the front element to out without
+    // popping it, if the write throws the element is still at the front.
+    template <typename OutputIt>
+    void writeFront(OutputIt& out) {
+        if constexpr (kStoreByValue) {
+            shared_ptr<T> item = make_shared<T> (std::move(q_.front()));
+            try {
+                *out++ = item;
+            } catch (...) {
+                q_.front() = std::move(*item);
+                throw;
+            }
+        } else {
+            *out++ = q_.front();
+        }
+    }
+
+    // Call holding the lock with the queue non empty.
+    T popValue() {
+        T val = std::move(q_.front());
+        q_.pop();
+        return val;
+    }
+
+    // Pops under the lock with pop if the queue is not empty.
+    template <typename Pop>
+    bool tryPopWith(Pop pop) {
+        lock_guard<mutex> lk(q_mt_);
+        if (q_.empty()) {
+            return false;
+        }
+        pop();
+        return true;
+    }
+
+    static chrono::steady_clock::time_point deadline(int duration_ms) {
+        return chrono::steady_clock::now() + chrono::milliseconds(duration_ms);
+    }
 
     public:
 
     void Push(T val) {
-        shared_ptr<T> val_ptr = make_shared<T> (val);
-        lock_guard<mutex> lk(q_mt_);
-        q_.push(val_ptr);
-        q_cnd_.notify_one();
+        Stored item = wrap(std::move(val));
+        {
+            lock_guard<mutex> lk(q_mt_);
+            q_.push(std::move(item));
+        }
+        not_empty_.NotifyOne();
     }
 
     shared_ptr<T> WaitAndPop() {
-        unique_lock<mutex> lk(q_mt_);
-        q_cnd_.wait(lk, [this] () { return !q_.empty();});
-        shared_ptr<T> val_ptr = q_.front();
-        q_.pop();
+        shared_ptr<T> val_ptr;
+        Await(not_empty_, [&] () { return tryPopWith([&] () { val_ptr = popShared(); }); });
         return val_ptr;
     }
 
@@ -36,19 +125,246 @@ class ThreadSafeQueue {
         if (q_.empty()) {
             return shared_ptr<T>();
         }
-        shared_ptr<T> val_ptr = q_.front();
-        q_.pop();
-        return val_ptr;
+        return popShared();
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    T WaitAndPopValue() {
+        optional<T> val;
+        Await(not_empty_, [&] () { return tryPopWith([&] () { val.emplace(popValue()); }); });
+        return std::move(*val);
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    void WaitAndPop(T& val) {
+        val = WaitAndPopValue();
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    optional<T> TryPopValue() {
+        lock_guard<mutex> lk(q_mt_);
+        if (q_.empty()) {
+            return nullopt;
+        }
+        return popValue();
+    }
+
+    template <typename U = T, IfByValue<U> = 0>
+    bool TryPop(T& val) {
+        optional<T> res = TryPopValue();
+        if (!res) {
+            return false;
+        }
+        val = std::move(*res);
+        return true;
+    }
+
+    // Allocates outside the lock, then appends the whole range in one critical section and wakes the
+    // consumers once for the batch.
+    template <typename Range>
+    void PushBulk(const Range& range) {
+        vector<Stored> items;
+        for (const auto& val : range) {
+            items.push_back(wrap(val));
+        }
+        if (items.empty()) {
+            return;
+        }
+
+        {
+            lock_guard<mutex> lk(q_mt_);
+            for (auto& item : items) {
+                q_.push(std::move(item));
+            }
+        }
+
+        if (items.size() == 1) {
+            not_empty_.NotifyOne();
+        } else {
+            not_empty_.NotifyAll();
+        }
+    }
+
+    // Waits up to duration_ms for the queue to become non empty, then moves up to max_n items into
+    // out under a single lock acquisition. Returns the number of items popped.
+    template <typename OutputIt>
+    size_t PopBulk(OutputIt out, size_t max_n, int duration_ms) {
+        if (max_n == 0) {
+            return 0;
+        }
+        size_t n = 0;
+        AwaitUntil(not_empty_, [&] () {
+            return tryPopWith([&] () {
+                while (n < max_n && !q_.empty()) {
+                    writeFront(out);
+                    q_.pop();
+                    n++;
+                }
+            });
+        }, deadline(duration_ms));
+        return n;
     }
 
     shared_ptr<T> TimedWaitAndPop(int duration_ms) {
-        auto timeout = chrono::system_clock::now() + chrono::milliseconds(duration_ms);
-        unique_lock<mutex> lk(q_mt_);
         shared_ptr<T> val_ptr;
-        if (q_cnd_.wait_until(lk, timeout, [this] () { return !q_.empty();})) {
-            val_ptr = q_.front();
-            q_.pop();
-        }
+        AwaitUntil(not_empty_, [&] () { return tryPopWith([&] () { val_ptr = popShared(); }); },
+                   deadline(duration_ms));
         return val_ptr;
     }
-};
\ No newline at end of file
+
+    template <typename U = T, IfByValue<U> = 0>
+    optional<T> TimedWaitAndPopValue(int duration_ms) {
+        optional<T> val;
+        AwaitUntil(not_empty_, [&] () { return tryPopWith([&] () { val.emplace(popValue()); }); },
+                   deadline(duration_ms));
+        return val;
+    }
+};
+
+// Its copy (and so its move) may throw, so the queue keeps it behind a shared_ptr.
+struct ThrowingCopy {
+    int v;
+
+    ThrowingCopy(int x) : v(x) {}
+
+    ThrowingCopy(const ThrowingCopy& other) : v(other.v) {}
+
+    bool operator==(const ThrowingCopy& other) const {
+        return v == other.v;
+    }
+};
+
+// Output iterator that collects into out and throws on write number fail_at.
+template <typename T>
+struct FailingInserter {
+    vector<shared_ptr<T> >* out;
+    size_t fail_at;
+
+    FailingInserter& operator*() {
+        return *this;
+    }
+
+    FailingInserter& operator++(int) {
+        return *this;
+    }
+
+    FailingInserter& operator=(const shared_ptr<T>& val) {
+        if (out->size() == fail_at) {
+            throw runtime_error("output full");
+        }
+        out->push_back(val);
+        return *this;
+    }
+};
+
+// make(i) builds element i.
+template <typename T, typename Make>
+void testBulk(Make make) {
+    ThreadSafeQueue<T> q;
+    vector<T> batch;
+    for (int i = 0; i < 100; i++) {
+        batch.push_back(make(i));
+    }
+
+    thread producer([&q, &batch]() {
+        for (int round = 0; round < 100; round++) {
+            q.PushBulk(batch);
+        }
+    });
+
+    int expected = 0;
+    int total = 0;
+    vector<shared_ptr<T> > out;
+    while (total < 100 * 100) {
+        out.clear();
+        size_t n = q.PopBulk(back_inserter(out), 64, 1000);
+        assert(n > 0 && n <= 64 && out.size() == n);
+        for (auto& val : out) {
+            assert(*val == make(expected));
+            expected = (expected + 1) % 100;
+        }
+        total += n;
+    }
+    producer.join();
+
+    size_t n = q.PopBulk(back_inserter(out), 64, 10);
+    assert(n == 0);
+
+    // Asking for nothing pops nothing, even with data queued.
+    q.PushBulk(batch);
+    out.clear();
+    n = q.PopBulk(back_inserter(out), 0, 10);
+    assert(n == 0 && out.empty());
+    shared_ptr<T> first = q.TryPop();
+    assert(first && *first == make(0));
+
+    // A write that throws leaves its element queued, the ones written before it are popped.
+    out.clear();
+    bool threw = false;
+    try {
+        q.PopBulk(FailingInserter<T>{&out, 2}, 10, 10);
+    } catch (const runtime_error&) {
+        threw = true;
+    }
+    assert(threw && out.size() == 2 && *out[0] == make(1) && *out[1] == make(2));
+    first = q.TryPop();
+    assert(first && *first == make(3));
+}
+
+void testValuePop() {
+    // Both storages, timing out and not.
+    ThreadSafeQueue<string> q;
+    for (int i = 0; i < 6; i++) {
+        q.Push("item-" + to_string(i));
+    }
+
+    optional<string> val = q.TryPopValue();
+    assert(val && *val == "item-0");
+    string out;
+    bool popped = q.TryPop(out);
+    assert(popped && out == "item-1");
+    out = q.WaitAndPopValue();
+    assert(out == "item-2");
+    q.WaitAndPop(out);
+    assert(out == "item-3");
+    val = q.TimedWaitAndPopValue(10);
+    assert(val && *val == "item-4");
+
+    // The shared_ptr interface is still there on the by value storage.
+    shared_ptr<string> shared = q.TimedWaitAndPop(10);
+    assert(shared && *shared == "item-5");
+
+    auto start = chrono::steady_clock::now();
+    val = q.TimedWaitAndPopValue(20);
+    assert(!val && chrono::steady_clock::now() - start >= chrono::milliseconds(20));
+    val = q.TryPopValue();
+    assert(!val);
+    popped = q.TryPop(out);
+    assert(!popped && out == "item-3");
+
+    ThreadSafeQueue<ThrowingCopy> tq;
+    for (int i = 0; i < 3; i++) {
+        tq.Push(ThrowingCopy(i));
+    }
+    shared_ptr<ThrowingCopy> item = tq.WaitAndPop();
+    assert(item && item->v == 0);
+    item = tq.TryPop();
+    assert(item && item->v == 1);
+    item = tq.TimedWaitAndPop(10);
+    assert(item && item->v == 2);
+
+    start = chrono::steady_clock::now();
+    item = tq.TimedWaitAndPop(20);
+    assert(!item && chrono::steady_clock::now() - start >= chrono::milliseconds(20));
+    item = tq.TryPop();
+    assert(!item);
+    cout << "Value pop test passed" << endl;
+}
+
+int main() {
+    testBulk<int>([](int i) { return i; });
+    testBulk<string>([](int i) { return "item-" + to_string(i); });
+    testBulk<ThrowingCopy>([](int i) { return ThrowingCopy(i); });
+    cout << "Bulk test passed" << endl;
+    testValuePop();
+}
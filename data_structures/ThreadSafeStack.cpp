@@ -1,87 +1,15 @@
 #include <iostream>
-#include <stack>
 #include <thread>
-#include <mutex>
-#include <condition_variable>
 #include <memory>
-#include <exception>
+#include <string>
+#include <optional>
+#include <cstdlib>
+#include <ctime>
+#include <cassert>
 
-using namespace std;
-
-/*
-1. First, basic thread safety can be ensured as each member is protected with a mutex
-2. There is still a race condition between empty and Pop, however, that is not problematic as 
-   the pop checks after holding the lock that the stack is not empty
-3. Locking a mutex may throw exception, but that is rare, and no data has been modified when the
-   exception is thrown, so good. Pop code can throw an exception, but again no data has been 
-   modified.
-4. Construting destructing must happen only once, so user of the stack object should ensure
-   that the object is fully constructed before being called and access to a partially 
-   constructed object should not be permitted.
-
-Performance:
-
-Only one thread is essentially doing work at a time. This serialization of threads can 
-limit the prformance of the application.
-*/
-
-
-template <typename T>
-class ThreadSafeStack {
-    stack<T> st_;
-    mutex st_mt_;
-    condition_variable st_cnd_;
-
-    public:
-
-    ThreadSafeStack() {} // default
-    ThreadSafeStack(const ThreadSafeStack& other) {
-        lock_guard<mutex> lk(st_mt_);
-        st_ = other.st_;
-    }
-    ThreadSafeStack& operator=(const ThreadSafeStack&) = delete;
-
-    void Push(T value) {
-        lock_guard<mutex> lk(st_mt_);
-        st_.push(value);
-        st_cnd_.notify_one();
-    }
-
-    shared_ptr<T> Pop() {
-        lock_guard<mutex> lk(st_mt_);
-        shared_ptr<T> val;
-        if (!st_.empty()) {
-            val = make_shared<T>(st_.top());
-            st_.pop();
-        }
+#include "ThreadSafeStack.h"
 
-        return val;
-    }
-
-    void Pop(T& value) {
-        lock_guard<mutex> lk(st_mt_);
-        if (st_.empty()) throw std::exception();
-        value = st_.top();
-        st_.pop();
-    }
-
-    void WaitAndPop(T& value) {
-        unique_lock<mutex> lk(st_mt_);
-        st_cnd_.wait(lk, [this] () { return !st_.empty(); });
-        value = st_.top();
-        st_.pop();
-    }
-
-    bool empty() {
-        lock_guard<mutex> lk(st_mt_);
-        return st_.empty();
-    }
-
-    int sz() {
-        lock_guard<mutex> lk(st_mt_);
-        return st_.size();
-    }
-};
+using namespace std;
 
 template<typename T>
 void threadFn(shared_ptr<ThreadSafeStack<T> > st, int adds, int removs) {
@@ -114,6 +42,23 @@ void test() {
 }
 
 
+void testValuePop() {
+    ThreadSafeStack<string> st;
+    st.Push("a");
+    st.Push("b");
+    st.Push("c");
+
+    optional<string> top = st.TryPopValue();
+    assert(*top == "c");
+    string next = st.WaitAndPopValue();
+    assert(next == "b");
+    shared_ptr<string> last = st.Pop();
+    assert(*last == "a");
+    top = st.TryPopValue();
+    assert(!top);
+}
+
 int main() {
     test();
+    testValuePop();
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <iostream>
+#include <stack>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+#include <optional>
+#include <type_traits>
+
+#include "EventCount.h"
+
+using namespace std;
+
+/*
+1. First, basic thread safety can be ensured as each member is protected with a mutex
+2. There is still a race condition between empty and Pop, however, that is not problematic as 
+   the pop checks after holding the lock that the stack is not empty
+3. Locking a mutex may throw exception, but that is rare, and no data has been modified when the
+   exception is thrown, so good. Pop code can throw an exception, but again no data has been 
+   modified.
+4. Construting destructing must happen only once, so user of the stack object should ensure
+   that the object is fully constructed before being called and access to a partially 
+   constructed object should not be permitted.
+
+Performance:
+
+Only one thread is essentially doing work at a time. This serialization of threads can 
+limit the prformance of the application.
+
+5. Elements are moved out of the stack with move_if_noexcept, so a T whose move can not throw is
+   never copied on pop. For such a T, TryPopValue / WaitAndPopValue return the value itself
+   (optional<T> / T) instead of a shared_ptr, which saves an allocation and the refcount per pop.
+   Moving it out can not throw, so point 3 still holds.
+*/
+
+
+template <typename T>
+class ThreadSafeStack {
+    stack<T> st_;
+    mutex st_mt_;
+    EventCount st_not_empty_;
+
+    // Call holding lk. Parks on the eventcount while the stack is empty, Push only pays for a wake
+    // when somebody is parked here.
+    void waitForData(unique_lock<mutex>& lk) {
+        while (st_.empty()) {
+            uint32_t key = st_not_empty_.PrepareWait();
+            if (!st_.empty()) {
+                st_not_empty_.CancelWait();
+                break;
+            }
+            lk.unlock();
+            st_not_empty_.Wait(key);
+            lk.lock();
+        }
+    }
+
+    template <typename U>
+    using IfNothrowMove = typename enable_if<is_nothrow_move_constructible<U>::value, int>::type;
+
+    public:
+
+    ThreadSafeStack() {} // default
+    ThreadSafeStack(const ThreadSafeStack& other) {
+        lock_guard<mutex> lk(st_mt_);
+        st_ = other.st_;
+    }
+    ThreadSafeStack& operator=(const ThreadSafeStack&) = delete;
+
+    void Push(T value) {
+        {
+            lock_guard<mutex> lk(st_mt_);
+            st_.push(std::move(value));
+        }
+        st_not_empty_.NotifyOne();
+    }
+
+    shared_ptr<T> Pop() {
+        lock_guard<mutex> lk(st_mt_);
+        shared_ptr<T> val;
+        if (!st_.empty()) {
+            val = make_shared<T>(std::move_if_noexcept(st_.top()));
+            st_.pop();
+        }
+
+        return val;
+    }
+
+    void Pop(T& value) {
+        lock_guard<mutex> lk(st_mt_);
+        if (st_.empty()) throw std::exception();
+        value = std::move_if_noexcept(st_.top());
+        st_.pop();
+    }
+
+    void WaitAndPop(T& value) {
+        unique_lock<mutex> lk(st_mt_);
+        waitForData(lk);
+        value = std::move_if_noexcept(st_.top());
+        st_.pop();
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    optional<T> TryPopValue() {
+        lock_guard<mutex> lk(st_mt_);
+        if (st_.empty()) {
+            return nullopt;
+        }
+        optional<T> val(std::move(st_.top()));
+        st_.pop();
+        return val;
+    }
+
+    template <typename U = T, IfNothrowMove<U> = 0>
+    T WaitAndPopValue() {
+        unique_lock<mutex> lk(st_mt_);
+        waitForData(lk);
+        T val = std::move(st_.top());
+        st_.pop();
+        return val;
+    }
+
+    bool empty() {
+        lock_guard<mutex> lk(st_mt_);
+        return st_.empty();
+    }
+
+    int sz() {
+        lock_guard<mutex> lk(st_mt_);
+        return st_.size();
+    }
+};